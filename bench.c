@@ -0,0 +1,378 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <string.h>
+#include <math.h>
+#include <err.h>
+
+#include "bench.h"
+#include "cache.h"
+#include "jbod.h"
+#include "mdadm.h"
+#include "net.h"
+#include "stats.h"
+#include "trace.h"
+#include "util.h"
+
+#define BENCH_ARGUMENTS "hw:s:p:Wgn:r:l:z:o:m:"
+#define USAGE                                                               \
+  "USAGE: bench [-h] [-w workload-file]... [-s sizes] [-p policies] [-W]\n" \
+  "             [-g] [-n ops] [-r read_pct] [-l min,max] [-z skew]\n"      \
+  "             [-o dir] [-m name]\n"                                      \
+  "\n"                                                                      \
+  "Replays each workload once per cache size and policy and prints a\n"   \
+  "row for each: ops/sec, p50 and p99 latency, hit rate and JBOD cost.\n" \
+  "\n"                                                                      \
+  "where:\n"                                                                \
+  "    -h - help mode (display this message)\n"                             \
+  "    -w - a workload to replay, as text or a binary trace; may be\n"   \
+  "         given several times, and defaults to simple-input,\n"     \
+  "         linear-input and random-input\n"                              \
+  "    -s - comma-separated cache sizes, 0 for no cache\n"                 \
+  "         (default " BENCH_DEFAULT_SIZES ")\n"                              \
+  "    -p - comma-separated cache policies (default " BENCH_DEFAULT_POLICIES ")\n" \
+  "    -W - write-back caching\n"                                           \
+  "    -g - also generate and replay the synthetic workloads: zipf\n"      \
+  "         hotspots, sequential scans, and both interleaved\n"             \
+  "    -n - reads and writes in each synthetic workload (default 20000)\n" \
+  "    -r - percentage of them that are reads (default 70)\n"              \
+  "    -l - smallest and largest request in bytes (default 1,1024)\n"      \
+  "    -z - Zipf exponent of the hotspots (default 0.99)\n"                \
+  "    -o - where to write the synthetic workloads (default /tmp)\n"       \
+  "    -m - talk to shm_server at this shared-memory name instead of\n"   \
+  "         the TCP server\n"                                              \
+  "\n"                                                                      \
+
+/* What jbod.o charges for each command, by which it reports the cost of a
+ * run; the server counts the same way */
+static const uint64_t cmd_cost[JBOD_NUM_CMDS] = {
+  [JBOD_MOUNT] = 1000,
+  [JBOD_UNMOUNT] = 1000,
+  [JBOD_SEEK_TO_DISK] = 500,
+  [JBOD_SEEK_TO_BLOCK] = 50,
+  [JBOD_READ_BLOCK] = 100,
+  [JBOD_WRITE_BLOCK] = 200,
+  [JBOD_SIGN_BLOCK] = 0,
+};
+
+/* What one replay measured */
+typedef struct {
+  int num_io;
+  double ops_per_sec;
+  uint64_t p50_us;
+  uint64_t p99_us;
+  double hit_pct;   /* negative without a cache */
+  uint64_t cost;
+} bench_result_t;
+
+static int run_once(const char *workload, int cache_size, cache_policy_t policy, bool write_back,
+                    bench_result_t *result);
+static int parse_list(char *list, int *values, int max, bool policies);
+
+int main(int argc, char *argv[])
+{
+  int ch, sizes[BENCH_MAX_SIZES], policies[CACHE_NUM_POLICIES], num_sizes, num_policies;
+  char size_list[256] = BENCH_DEFAULT_SIZES, policy_list[256] = BENCH_DEFAULT_POLICIES;
+  char *workloads[BENCH_MAX_WORKLOADS];
+  char generated[BENCH_NUM_SHAPES][512];
+  const char *dir = "/tmp";
+  char server[256] = JBOD_SERVER;
+  int num_workloads = 0;
+  bool write_back = false, generate = false;
+  bench_mix_t mix = { .num_ops = 20000, .read_pct = 70, .min_len = 1, .max_len = BENCH_MAX_IO_SIZE, .zipf_skew = 0.99 };
+
+  while ((ch = getopt(argc, argv, BENCH_ARGUMENTS)) != -1) {
+    switch (ch) {
+      case 'h':
+        fprintf(stderr, USAGE);
+        return 0;
+      case 'w':
+        if (num_workloads == BENCH_MAX_WORKLOADS - BENCH_NUM_SHAPES)
+          errx(1, "Too many workloads, aborting.");
+        workloads[num_workloads++] = optarg;
+        break;
+      case 's':
+        snprintf(size_list, sizeof(size_list), "%s", optarg);
+        break;
+      case 'p':
+        snprintf(policy_list, sizeof(policy_list), "%s", optarg);
+        break;
+      case 'W':
+        write_back = true;
+        break;
+      case 'g':
+        generate = true;
+        break;
+      case 'n':
+        mix.num_ops = atoi(optarg);
+        break;
+      case 'r':
+        mix.read_pct = atoi(optarg);
+        break;
+      case 'l':
+        if (sscanf(optarg, "%d,%d", &mix.min_len, &mix.max_len) != 2)
+          errx(1, "Invalid request sizes %s, aborting.", optarg);
+        break;
+      case 'z':
+        mix.zipf_skew = atof(optarg);
+        break;
+      case 'o':
+        dir = optarg;
+        break;
+      case 'm':
+        snprintf(server, sizeof(server), "%s%s", JBOD_SHM_PREFIX, optarg);
+        break;
+      default:
+        fprintf(stderr, "Unknown command line option (%c), aborting.\n", ch);
+        return -1;
+    }
+  }
+
+  if (mix.num_ops < 1 || mix.read_pct < 0 || mix.read_pct > 100 || mix.min_len < 1 ||
+      mix.min_len > mix.max_len || mix.max_len > BENCH_MAX_IO_SIZE || mix.zipf_skew < 0)
+    errx(1, "Invalid synthetic workload settings, aborting.");
+  if ((num_sizes = parse_list(size_list, sizes, BENCH_MAX_SIZES, false)) == -1)
+    errx(1, "Invalid cache sizes %s, aborting.", size_list);
+  if ((num_policies = parse_list(policy_list, policies, CACHE_NUM_POLICIES, true)) == -1)
+    errx(1, "Invalid cache policies %s, aborting.", policy_list);
+
+  if (num_workloads == 0) {
+    workloads[num_workloads++] = "simple-input";
+    workloads[num_workloads++] = "linear-input";
+    workloads[num_workloads++] = "random-input";
+  }
+  if (generate) {
+    for (int i = 0; i < BENCH_NUM_SHAPES; ++i) {
+      snprintf(generated[i], sizeof(generated[i]), "%s/bench-%s-input", dir, bench_shape_name(i));
+      FILE *f = fopen(generated[i], "w");
+      if (!f)
+        err(1, "Cannot create workload file %s", generated[i]);
+      if (bench_generate(f, i, &mix) != 1 || fclose(f) != 0)
+        err(1, "Cannot write workload file %s", generated[i]);
+      workloads[num_workloads++] = generated[i];
+    }
+  }
+
+  if (!jbod_connect(server, JBOD_PORT))
+    errx(1, "Cannot connect to the JBOD server.");
+
+  printf("%-28s %6s %-6s %7s %9s %7s %7s %6s %10s\n",
+         "workload", "cache", "policy", "ops", "ops/sec", "p50_us", "p99_us", "hit%", "cost");
+  for (int w = 0; w < num_workloads; ++w)
+    for (int s = 0; s < num_sizes; ++s)
+      /* without a cache the policy makes no difference, so it runs once */
+      for (int p = 0; p < (sizes[s] ? num_policies : 1); ++p) {
+        bench_result_t r;
+        if (run_once(workloads[w], sizes[s], policies[p], write_back, &r) == -1) {
+          jbod_disconnect();
+          errx(1, "Replaying %s failed, aborting.", workloads[w]);
+        }
+        char hit[16] = "-";
+        if (r.hit_pct >= 0)
+          snprintf(hit, sizeof(hit), "%.1f", r.hit_pct);
+        printf("%-28s %6d %-6s %7d %9.0f %7llu %7llu %6s %10llu\n",
+               workloads[w], sizes[s], sizes[s] ? cache_policy_name(policies[p]) : "-",
+               r.num_io, r.ops_per_sec, (unsigned long long) r.p50_us,
+               (unsigned long long) r.p99_us, hit, (unsigned long long) r.cost);
+        fflush(stdout);
+      }
+
+  jbod_disconnect();
+  return 0;
+}
+
+/* Reads the comma-separated cache sizes, or policy names if |policies|, in
+ * |list| into |values|. Returns how many there were, or -1 if any is invalid
+ * or there are more than |max|. */
+static int parse_list(char *list, int *values, int max, bool policies)
+{
+  int n = 0;
+  for (char *item = strtok(list, ","); item; item = strtok(NULL, ",")) {
+    if (n == max)
+      return -1;
+    if (policies) {
+      int p;
+      for (p = 0; p < CACHE_NUM_POLICIES; ++p)
+        if (strcmp(item, cache_policy_name(p)) == 0)
+          break;
+      if (p == CACHE_NUM_POLICIES)
+        return -1;
+      values[n++] = p;
+    } else {
+      values[n] = atoi(item);
+      if (values[n] != 0 && (values[n] < 2 || values[n] > 4096))
+        return -1;
+      ++n;
+    }
+  }
+  return n ? n : -1;
+}
+
+/* Fills in |delta| with what a latency histogram gained from |before| to |after|. */
+static void hist_delta(stats_hist_t *delta, const stats_hist_t *after, const stats_hist_t *before)
+{
+  delta->count = after->count - before->count;
+  delta->total_ns = after->total_ns - before->total_ns;
+  delta->max_ns = after->max_ns;
+  for (int i = 0; i < STATS_HIST_BUCKETS; ++i)
+    delta->buckets[i] = after->buckets[i] - before->buckets[i];
+}
+
+/* Replays |workload| with a cache of |cache_size| entries (none if 0) under
+ * |policy|, and fills in |result|. Returns 1 on success and -1 on failure. */
+static int run_once(const char *workload, int cache_size, cache_policy_t policy, bool write_back,
+                    bench_result_t *result)
+{
+  static uint8_t buf[MDADM_VOLUME_SIZE];
+  mdadm_stats_t md_before, md_after;
+  cache_stats_t cs_before, cs_after;
+  jbod_stats_t js_before, js_after;
+  trace_t trace;
+  const trace_op_t *op;
+  bool mounted = false;
+  int rc = 1;
+
+  if (trace_open(workload, &trace) != 1)
+    err(1, "Cannot open workload file %s", workload);
+
+  if (cache_size) {
+    if (cache_set_policy(policy) != 1 || cache_create(cache_size) != 1)
+      errx(1, "Failed to create cache.");
+    mdadm_set_write_back(write_back);
+  }
+  mdadm_get_stats(&md_before);
+  cache_get_stats(&cs_before);
+  jbod_get_stats(&js_before);
+
+  result->num_io = 0;
+  uint64_t started = stats_now_ns();
+  while (rc == 1 && (rc = trace_next(&trace, &op)) == 1) {
+    if (op->cmd == TRACE_MOUNT) {
+      rc = mdadm_mount();
+      mounted = (rc == 1);
+    } else if (op->cmd == TRACE_UNMOUNT) {
+      rc = mdadm_unmount();
+      mounted = false;
+    } else if (op->cmd == TRACE_SIGNALL) {
+      /* the signatures are of no interest here, only what they cost */
+      rc = cache_flush();
+      for (int d = 0; d < JBOD_NUM_DISKS && rc == 1; ++d)
+        for (int b = 0; b < JBOD_NUM_BLOCKS_PER_DISK; ++b) {
+          uint8_t sig[JBOD_BLOCK_SIZE];
+          jbod_client_operation(JBOD_SIGN_BLOCK << 14 | d << 28 | b << 20, sig);
+        }
+    } else if (op->len <= MDADM_VOLUME_SIZE) {
+      uint32_t addr = op->addr, len = op->len;
+      ++result->num_io;
+      if (op->cmd == TRACE_READ) {
+        rc = (len > MDADM_MAX_IO_SIZE ? mdadm_stream_read(addr, len, buf) : mdadm_read(addr, len, buf)) == -1 ? -1 : 1;
+      } else {
+        memset(buf, op->fill, len);
+        rc = (len > MDADM_MAX_IO_SIZE ? mdadm_stream_write(addr, len, buf) : mdadm_write(addr, len, buf)) == -1 ? -1 : 1;
+      }
+    } else {
+      rc = -1;
+    }
+  }
+  /* the end of the workload is where a good run stops */
+  if (rc == 0)
+    rc = 1;
+  /* leave the server unmounted for the next run, whatever happened */
+  if (mounted && mdadm_unmount() == -1)
+    rc = -1;
+  double secs = (stats_now_ns() - started) / 1e9;
+  trace_close(&trace);
+  if (cache_size)
+    cache_destroy();
+
+  mdadm_get_stats(&md_after);
+  cache_get_stats(&cs_after);
+  jbod_get_stats(&js_after);
+
+  /* reads and writes together make up the latency distribution */
+  stats_hist_t reads, writes;
+  hist_delta(&reads, &md_after.read_latency, &md_before.read_latency);
+  hist_delta(&writes, &md_after.write_latency, &md_before.write_latency);
+  for (int i = 0; i < STATS_HIST_BUCKETS; ++i)
+    reads.buckets[i] += writes.buckets[i];
+  result->p50_us = stats_hist_percentile_us(&reads, 50);
+  result->p99_us = stats_hist_percentile_us(&reads, 99);
+  result->ops_per_sec = secs > 0 ? result->num_io / secs : 0;
+
+  uint64_t queries = cs_after.queries - cs_before.queries;
+  result->hit_pct = (cache_size && queries) ? 100.0 * (cs_after.hits - cs_before.hits) / queries : -1;
+
+  result->cost = 0;
+  for (int i = 0; i < JBOD_NUM_CMDS; ++i)
+    result->cost += (js_after.commands[i] - js_before.commands[i]) * cmd_cost[i];
+  return rc;
+}
+
+const char *bench_shape_name(bench_shape_t shape)
+{
+  static const char *names[BENCH_NUM_SHAPES] = { "zipf", "scan", "mixed" };
+  return (shape >= 0 && shape < BENCH_NUM_SHAPES) ? names[shape] : "unknown";
+}
+
+/* Returns a uniformly random number in [0, 1). */
+static double uniform(void)
+{
+  return get_rand(0, 999999999) / 1e9;
+}
+
+/* Returns the block of the |rank|th most popular Zipf hotspot. Multiplying by
+ * an odd number permutes the blocks, so the hot ones spread over the disks
+ * rather than crowding onto the first. */
+static uint32_t hotspot_block(int rank)
+{
+  return (uint32_t) rank * 2654435761u % BENCH_NUM_BLOCKS;
+}
+
+int bench_generate(FILE *f, bench_shape_t shape, const bench_mix_t *mix)
+{
+  static double cdf[BENCH_NUM_BLOCKS];
+  uint32_t cursor = 0; /* where the sequential sweep is up to */
+
+  /* the chance of each rank is proportional to 1 / (rank + 1)^skew */
+  double total = 0;
+  for (int i = 0; i < BENCH_NUM_BLOCKS; ++i)
+    cdf[i] = (total += 1.0 / pow(i + 1, mix->zipf_skew));
+  for (int i = 0; i < BENCH_NUM_BLOCKS; ++i)
+    cdf[i] /= total;
+
+  fprintf(f, "MOUNT\n");
+  for (int n = 0; n < mix->num_ops; ++n) {
+    uint32_t len = get_rand(mix->min_len, mix->max_len), addr;
+    bool scan = (shape == BENCH_SCAN) || (shape == BENCH_MIXED && get_rand(0, 1) == 1);
+
+    if (scan) {
+      if (cursor + len > MDADM_VOLUME_SIZE)
+        cursor = 0;
+      addr = cursor;
+      cursor += len;
+    } else {
+      /* the first rank the cumulative distribution reaches a uniform draw at */
+      double u = uniform();
+      int lo = 0, hi = BENCH_NUM_BLOCKS - 1;
+      while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (cdf[mid] < u)
+          lo = mid + 1;
+        else
+          hi = mid;
+      }
+      addr = hotspot_block(lo) * JBOD_BLOCK_SIZE + get_rand(0, JBOD_BLOCK_SIZE - 1);
+      if (addr + len > MDADM_VOLUME_SIZE)
+        addr = MDADM_VOLUME_SIZE - len;
+    }
+
+    if (get_rand(0, 99) < (uint32_t) mix->read_pct)
+      fprintf(f, "READ %u %u 0\n", addr, len);
+    else
+      fprintf(f, "WRITE %u %u %u\n", addr, len, get_rand(0, 255));
+  }
+  fprintf(f, "UNMOUNT\n");
+  return ferror(f) ? -1 : 1;
+}
@@ -0,0 +1,49 @@
+#ifndef BENCH_H_
+#define BENCH_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "jbod.h"
+
+/* Cache sizes and policies bench sweeps when not told otherwise */
+#define BENCH_DEFAULT_SIZES "0,16,64,256,1024,4096"
+#define BENCH_DEFAULT_POLICIES "lru,clock,2q"
+
+/* Most cache sizes and workloads one run of bench takes */
+#define BENCH_MAX_SIZES 16
+#define BENCH_MAX_WORKLOADS 16
+
+/* Longest request a generated workload makes, which mdadm_read and
+ * mdadm_write take in one call */
+#define BENCH_MAX_IO_SIZE 1024
+
+/* Blocks the Zipf hotspots are drawn from: the whole volume */
+#define BENCH_NUM_BLOCKS (JBOD_NUM_DISKS * JBOD_NUM_BLOCKS_PER_DISK)
+
+/* The shapes of synthetic workload bench generates */
+typedef enum {
+  BENCH_ZIPF, /* requests at blocks drawn from a Zipf distribution */
+  BENCH_SCAN, /* sequential sweeps over the whole volume */
+  BENCH_MIXED, /* Zipf hotspots and a sweep, interleaved half and half */
+  BENCH_NUM_SHAPES
+} bench_shape_t;
+
+/* What the synthetic workloads look like */
+typedef struct {
+  int num_ops;      /* reads and writes in each workload */
+  int read_pct;     /* share of them that are reads, 0 to 100 */
+  int min_len;      /* request sizes are drawn uniformly from min_len */
+  int max_len;      /* to max_len bytes, at most BENCH_MAX_IO_SIZE */
+  double zipf_skew; /* Zipf exponent: 0 is uniform, higher is more skewed */
+} bench_mix_t;
+
+/* Writes a workload of |shape| made to |mix| to |f|, in the format tester
+ * reads: MOUNT, the reads and writes, then UNMOUNT. Random choices come from
+ * get_rand. Returns 1 on success and -1 on failure. */
+int bench_generate(FILE *f, bench_shape_t shape, const bench_mix_t *mix);
+
+/* Returns the name of |shape|: "zipf", "scan" or "mixed". */
+const char *bench_shape_name(bench_shape_t shape);
+
+#endif
@@ -0,0 +1,197 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <stdatomic.h>
+
+#include "blockmap.h"
+
+#define BLOCKMAP_NUM_BLOCKS (JBOD_NUM_DISKS * JBOD_NUM_BLOCKS_PER_DISK)
+#define BLOCKMAP_KEY(disk_num, block_num) ((disk_num) * JBOD_NUM_BLOCKS_PER_DISK + (block_num))
+
+/* A block's state: 0 while what it holds is not known, or KNOWN with the byte
+ * it repeats in the low bits. A state is read and written in one go, so a
+ * reader never sees the flag of one write with the byte of another. */
+#define KNOWN 0x100
+#define FILL_MASK 0xff
+
+/* A map file starts with the magic and the geometry of the volume it
+ * describes, followed by the state of every block, disk by disk. */
+#define BLOCKMAP_MAGIC "JBODMAP1"
+typedef struct {
+  char magic[8];
+  uint32_t num_disks;
+  uint32_t blocks_per_disk;
+  uint32_t block_size;
+} map_header_t;
+
+static bool enabled = false;
+static bool mounted = false;
+static char map_path[PATH_MAX]; // the map file, or "" for none
+static uint16_t states[BLOCKMAP_NUM_BLOCKS];
+
+static atomic_ulong num_hits = 0;
+static unsigned long num_loaded = 0;
+static unsigned long num_stale = 0;
+
+int blockmap_set(bool enable, const char *path) {
+  if (mounted || (path != NULL && strlen(path) >= sizeof(map_path))) {
+    return -1;
+  }
+  enabled = enable;
+  snprintf(map_path, sizeof(map_path), "%s", enable && path ? path : "");
+  return 1;
+}
+
+bool blockmap_enabled(void) {
+  return enabled;
+}
+
+/* Returns the header a map file of this volume starts with. */
+static map_header_t file_header(void) {
+  map_header_t header = { .num_disks = JBOD_NUM_DISKS, .blocks_per_disk = JBOD_NUM_BLOCKS_PER_DISK,
+                          .block_size = JBOD_BLOCK_SIZE };
+  memcpy(header.magic, BLOCKMAP_MAGIC, sizeof(header.magic));
+  return header;
+}
+
+/* Loads the states from the map file. Returns 1 if it did, 0 if there is no
+ * file, and -1 if the file is of no use: of another geometry, or cut short. */
+static int load_map(void) {
+  FILE *f = fopen(map_path, "rb");
+  if (f == NULL) {
+    return 0;
+  }
+  map_header_t header, expected = file_header();
+  bool ok = fread(&header, sizeof(header), 1, f) == 1 && memcmp(&header, &expected, sizeof(header)) == 0 &&
+            fread(states, sizeof(states), 1, f) == 1 && fgetc(f) == EOF;
+  fclose(f);
+  return ok ? 1 : -1;
+}
+
+/* Writes the states to the map file. Returns 1 on success and -1 on failure. */
+static int save_map(void) {
+  char tmp_path[PATH_MAX + 4];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", map_path);
+  FILE *f = fopen(tmp_path, "wb");
+  if (f == NULL) {
+    return -1;
+  }
+  map_header_t header = file_header();
+  bool ok = fwrite(&header, sizeof(header), 1, f) == 1 && fwrite(states, sizeof(states), 1, f) == 1;
+  if (fclose(f) != 0 || !ok || rename(tmp_path, map_path) == -1) {
+    unlink(tmp_path);
+    return -1;
+  }
+  return 1;
+}
+
+int blockmap_mount(blockmap_read_fn read) {
+  if (!enabled) {
+    return 1;
+  }
+  mounted = true;
+
+  // Without a file, the volume is as MOUNT leaves it: zeros throughout
+  int loaded = map_path[0] != '\0' ? load_map() : 0;
+  if (loaded == 0) {
+    for (int i = 0; i < BLOCKMAP_NUM_BLOCKS; i++) {
+      states[i] = KNOWN | 0;
+    }
+  } else if (loaded == 1) {
+    num_loaded++;
+  }
+
+  // Read back every known block in one batch, as cache_validate_snapshot does
+  int n = 0;
+  int *disk_nums = malloc(BLOCKMAP_NUM_BLOCKS * sizeof(int));
+  int *block_nums = malloc(BLOCKMAP_NUM_BLOCKS * sizeof(int));
+  uint8_t *bufs = malloc((size_t) BLOCKMAP_NUM_BLOCKS * JBOD_BLOCK_SIZE);
+  if (disk_nums == NULL || block_nums == NULL || bufs == NULL) {
+    loaded = -1;
+  }
+  for (int i = 0; loaded != -1 && i < BLOCKMAP_NUM_BLOCKS; i++) {
+    if (states[i] & KNOWN) {
+      disk_nums[n] = i / JBOD_NUM_BLOCKS_PER_DISK;
+      block_nums[n++] = i % JBOD_NUM_BLOCKS_PER_DISK;
+    }
+  }
+  if (loaded != -1 && n > 0 && read(n, disk_nums, block_nums, bufs) != 1) {
+    loaded = -1;
+  }
+  for (int i = 0; loaded != -1 && i < n; i++) {
+    uint8_t block[JBOD_BLOCK_SIZE];
+    blockmap_lookup(disk_nums[i], block_nums[i], block);
+    if (memcmp(bufs + (size_t) i * JBOD_BLOCK_SIZE, block, JBOD_BLOCK_SIZE) != 0) {
+      loaded = -1;
+    }
+  }
+  free(disk_nums);
+  free(block_nums);
+  free(bufs);
+  // The check's lookups count as hits otherwise
+  num_hits = 0;
+
+  if (loaded == -1) {
+    num_stale++;
+    memset(states, 0, sizeof(states));
+    return -1;
+  }
+  return 1;
+}
+
+int blockmap_unmount(void) {
+  if (!mounted) {
+    return 1;
+  }
+  mounted = false;
+  return map_path[0] != '\0' ? save_map() : 1;
+}
+
+bool blockmap_lookup(int disk_num, int block_num, uint8_t *buf) {
+  if (!mounted) {
+    return false;
+  }
+  uint16_t state = __atomic_load_n(&states[BLOCKMAP_KEY(disk_num, block_num)], __ATOMIC_RELAXED);
+  if (!(state & KNOWN)) {
+    return false;
+  }
+  memset(buf, state & FILL_MASK, JBOD_BLOCK_SIZE);
+  num_hits++;
+  return true;
+}
+
+bool blockmap_known(int disk_num, int block_num) {
+  return mounted && (__atomic_load_n(&states[BLOCKMAP_KEY(disk_num, block_num)], __ATOMIC_RELAXED) & KNOWN);
+}
+
+void blockmap_record(int disk_num, int block_num, const uint8_t *buf) {
+  if (!mounted) {
+    return;
+  }
+  // A block of one repeated byte matches itself shifted by a byte
+  uint16_t state = 0;
+  if (buf != NULL && memcmp(buf, buf + 1, JBOD_BLOCK_SIZE - 1) == 0) {
+    state = KNOWN | buf[0];
+  }
+  __atomic_store_n(&states[BLOCKMAP_KEY(disk_num, block_num)], state, __ATOMIC_RELAXED);
+}
+
+void blockmap_get_stats(blockmap_stats_t *stats) {
+  stats->hits = num_hits;
+  stats->known = 0;
+  for (int i = 0; mounted && i < BLOCKMAP_NUM_BLOCKS; i++) {
+    stats->known += (__atomic_load_n(&states[i], __ATOMIC_RELAXED) & KNOWN) != 0;
+  }
+  stats->loaded = num_loaded;
+  stats->stale = num_stale;
+}
+
+void blockmap_print(void) {
+  if (!enabled) {
+    return;
+  }
+  fprintf(stderr, "Block map: %lu block reads answered locally%s%s\n", (unsigned long) num_hits,
+          num_loaded > 0 ? ", map loaded from file" : "", num_stale > 0 ? ", map dropped as stale" : "");
+}
@@ -0,0 +1,71 @@
+#ifndef BLOCKMAP_H_
+#define BLOCKMAP_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "jbod.h"
+
+/* The block map: for every block of the volume, whether the client knows what
+ * it holds without asking the server, as it does for a block of one repeated
+ * byte. jbod.o zeroes the disks on MOUNT, so a mount starts with every block
+ * known to be zeros; a write of one repeated byte keeps its block known, and
+ * any other write makes it unknown. mdadm answers reads of known blocks from
+ * the map, so scanning a sparse volume costs next to nothing. Blocks are kept
+ * by disk and block, whatever the layout. Like the cache, the map assumes no
+ * other client writes to the volume. */
+
+/* Reads the |n| blocks at |disk_nums| and |block_nums| from the volume into
+ * the consecutive blocks of |bufs|, as one pipelined batch; returns 1 on
+ * success and -1 on failure. */
+typedef int (*blockmap_read_fn)(int n, const int *disk_nums, const int *block_nums, uint8_t *bufs);
+
+/* Returns 1 on success and -1 on failure. Turns the map on or off. With a
+ * |path|, the map is saved to that file on unmount and loaded from it on the
+ * next mount, which a server that keeps its disks across mounts (server -i)
+ * needs; NULL keeps it in memory only. Fails while mounted. */
+int blockmap_set(bool enabled, const char *path);
+
+/* Returns true if the map is on. */
+bool blockmap_enabled(void);
+
+/* Sets the map up for a volume that was just mounted: from the map file if
+ * there is one, or else with every block known to be zeros. Every known block
+ * is then read back with |read|; one that differs means the map does not
+ * describe the volume, and it starts over with every block unknown. Returns 1
+ * if the map was kept and -1 if not. Does nothing while the map is off. */
+int blockmap_mount(blockmap_read_fn read);
+
+/* Returns 1 on success and -1 on failure. Saves the map to its file, if it
+ * has one, and forgets it until the next blockmap_mount. The file is written
+ * beside the old one and renamed over it, so a failed save leaves the old one
+ * whole. */
+int blockmap_unmount(void);
+
+/* Returns true, with the block in |buf|, if the block at |disk_num| and
+ * |block_num| is known. Safe to call from several threads at once. */
+bool blockmap_lookup(int disk_num, int block_num, uint8_t *buf);
+
+/* Returns true if the block at |disk_num| and |block_num| is known. */
+bool blockmap_known(int disk_num, int block_num);
+
+/* Records that the block at |disk_num| and |block_num| now holds |buf|, or,
+ * for NULL, that what it holds is not known. Safe to call from several
+ * threads at once, for different blocks. */
+void blockmap_record(int disk_num, int block_num, const uint8_t *buf);
+
+/* What the map has done since the program started */
+typedef struct {
+  uint64_t hits;         /* blocks blockmap_lookup answered */
+  uint64_t known;        /* blocks known now */
+  uint64_t loaded;       /* mounts that started from the map file */
+  uint64_t stale;        /* mounts whose map blockmap_mount found wrong */
+} blockmap_stats_t;
+
+/* Fills in |stats|. */
+void blockmap_get_stats(blockmap_stats_t *stats);
+
+/* Prints how many block reads the map answered, if it is on. */
+void blockmap_print(void);
+
+#endif
@@ -1,132 +1,1299 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "cache.h"
 
+/* Every (disk, block) pair of the JBOD maps to a unique key, so the index is a
+ * direct-mapped table over the whole key space: a perfect hash with no
+ * collisions and no probing. */
+#define CACHE_NUM_KEYS (JBOD_NUM_DISKS * JBOD_NUM_BLOCKS_PER_DISK)
+#define CACHE_KEY(disk_num, block_num) ((disk_num) * JBOD_NUM_BLOCKS_PER_DISK + (block_num))
+
+/* A recency list of entries, linked through their prev and next fields. */
+typedef struct {
+  int head;   // most recently used entry
+  int tail;   // least recently used entry
+  int len;
+} cache_list_t;
+
+/* The lists 2Q keeps: A1in holds blocks on their first use in FIFO order, Am
+ * the blocks used again after leaving A1in, in LRU order. LRU uses A1in alone. */
+#define Q_A1IN 0
+#define Q_AM 1
+
+/* The contents of a cached block. Each entry holds a reference to one; when
+ * deduplicating, entries with the same contents share it. The bytes are kept
+ * in a chunk of the slab, packed as pack() packs them. */
+typedef struct {
+  uint32_t hash;  // of the contents, when deduplicating
+  int refs;       // entries holding it, 0 when free
+  int next;       // next body in its hash bucket, or on the free list
+  uint32_t off;   // its chunk of the slab
+  uint16_t cap;   // bytes in the chunk, 0 for none
+  uint16_t len;   // bytes used: JBOD_BLOCK_SIZE as is, fewer compressed, 0 all fill
+  uint8_t fill;   // the byte a block of one repeated byte repeats
+} cache_body_t;
+
+/* A block packed the way a body stores it (see pack) */
+typedef struct {
+  const uint8_t *bytes;
+  int len;
+  uint8_t fill;
+  uint8_t buf[JBOD_BLOCK_SIZE];
+} packed_t;
+
+/* The slab hands out chunks in multiples of SLAB_CHUNK bytes, one free list
+ * per size */
+#define SLAB_CHUNK 16
+#define SLAB_CLASSES (JBOD_BLOCK_SIZE / SLAB_CHUNK)
+#define SLAB_NONE UINT32_MAX
+
+/* The entries are split into shards by key, each with its own slots, bodies,
+ * lock and replacement state, so threads working on different blocks rarely
+ * wait for each other. Eviction is decided within a shard; with one shard it
+ * follows the policy exactly. */
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t written_back; // signalled as each write-back of an evicted entry ends
+  int base;       // first slot of the shard
+  int size;       // number of slots
+  int num_used;   // slots [base, base + num_used) have been used
+  int num_cached; // valid entries, not counting those out being written back
+  int free_slot;  // slots emptied to free a body, linked through next, or -1
+  int body_base;  // first body of the shard
+  int num_bodies;
+  int free_body;  // free bodies, linked through next, or -1
+  int bodies_used;
+  int *buckets;   // when deduplicating: hash -> first body in the bucket, or -1
+  int num_buckets;
+  uint32_t slab_base; // first byte of the shard's part of the slab
+  uint32_t slab_size;
+  uint32_t slab_used; // bytes from slab_base ever handed out
+  uint32_t free_chunks[SLAB_CLASSES]; // free chunks of each size, or SLAB_NONE
+  cache_list_t lists[2];
+  int hand;       // CLOCK: next slot, relative to base, the hand looks at
+  int a1in_max;   // 2Q: A1in is evicted from first while longer than this
+  int *ghosts;    // 2Q: ring of the keys last evicted from A1in (A1out)
+  int ghost_size;
+  int ghost_head; // oldest key in the ring
+  int ghost_count;
+} cache_shard_t;
+
+/* What a replacement policy does at each point of an entry's life. The shard
+ * is locked throughout. */
+typedef struct {
+  const char *name;
+  void (*admit)(cache_shard_t *s, int i, int key); // entry i now holds key
+  void (*touch)(cache_shard_t *s, int i);          // entry i was used
+  int (*victim)(cache_shard_t *s);                 // entry to evict from a full shard
+  void (*evict)(cache_shard_t *s, int i);          // entry i leaves the cache
+} cache_policy_ops_t;
+
+/* A snapshot file starts with the magic and the geometry of the volume its
+ * blocks came from, followed by num_entries records, oldest first. */
+#define SNAPSHOT_MAGIC "JBODCSN1"
+typedef struct {
+  char magic[8];
+  uint32_t num_disks;
+  uint32_t blocks_per_disk;
+  uint32_t block_size;
+  uint32_t num_entries;
+} snapshot_header_t;
+
+typedef struct {
+  int32_t disk_num;
+  int32_t block_num;
+  uint8_t block[JBOD_BLOCK_SIZE];
+} snapshot_record_t;
+
+#define SHARD_OF(key) (&shards[(key) % num_shards])
+
+/* A key in the A1out ring of its shard maps to -2 - its position there. */
+#define GHOST(pos) (-2 - (pos))
+
 static cache_entry_t *cache = NULL;
-static int cache_size = 0;
-static int clock = 0;
-static int num_queries = 0;
-static int num_hits = 0;
+static int cache_size = 0;        // slots
+static cache_body_t *bodies = NULL;
+static int *body_buckets = NULL;  // the hash buckets of all shards, when deduplicating
+static uint8_t *slab = NULL;      // the bytes of all bodies
+static bool dedup = false;
+static bool compress = false;
+static int compressed_blocks = 0; // bodies in use when the cache was last destroyed,
+static int compressed_bytes = 0;  // the slab bytes they took,
+static int fill_blocks = 0;       // and how many were of one repeated byte
+static atomic_int num_dedup_hits = 0;
+static int dedup_entries = 0;     // entries and bodies in use when the cache was last destroyed
+static int dedup_bodies = 0;
+static int *cache_index = NULL;   // key -> entry slot, -1 when not cached, GHOST(pos) when on A1out
+static int *ghost_keys = NULL;    // the A1out rings of all shards
+static bool *writing_back = NULL; // key -> whether its evicted entry is on its way to the server
+static cache_shard_t shards[CACHE_MAX_SHARDS];
+static int num_shards = 0;
+static cache_policy_t policy = CACHE_LRU;
+static const cache_policy_ops_t *ops = NULL;
+static atomic_int num_queries = 0;
+static atomic_int num_hits = 0;
+static cache_writeback_fn writeback = NULL; // NULL means write-through
+static atomic_int num_prefetched = 0;
+static atomic_int num_prefetch_hits = 0;
+static atomic_int num_prefetch_wasted = 0;
+static atomic_int num_insertions = 0;
+static atomic_int num_evictions = 0;
+static atomic_int num_writebacks = 0;
+static char snapshot_path[PATH_MAX]; // where cache_destroy saves and cache_create restores, or ""
+static bool snapshot_unchecked = false; // restored entries cache_validate_snapshot has yet to check
+static atomic_int num_restored = 0;
+static atomic_int num_restored_stale = 0;
+
+/* The L2 tier: a file mapped into memory with a block for every key, which
+ * entries evicted from the entries above (L1) are demoted to and promoted back
+ * from. The tiers are exclusive, so a block is in L1 or L2, never both, and a
+ * key's L2 block is guarded by the lock of the key's shard. */
+static char l2_path[PATH_MAX];   // the file, or "" for no L2
+static uint8_t (*l2)[JBOD_BLOCK_SIZE] = NULL;
+static bool *l2_valid = NULL;    // key -> whether its L2 block holds it
+static atomic_int num_l2_hits = 0;
+static atomic_int num_demotions = 0;
+
+/* Unlinks entry |i| from |list|. */
+static void list_unlink(cache_list_t *list, int i) {
+  if (cache[i].prev != -1)
+    cache[cache[i].prev].next = cache[i].next;
+  else
+    list->head = cache[i].next;
+
+  if (cache[i].next != -1)
+    cache[cache[i].next].prev = cache[i].prev;
+  else
+    list->tail = cache[i].prev;
+  list->len--;
+}
+
+/* Links entry |i| in at the most recently used end of |list|. */
+static void list_push_front(cache_list_t *list, int i) {
+  cache[i].prev = -1;
+  cache[i].next = list->head;
+  if (list->head != -1)
+    cache[list->head].prev = i;
+  list->head = i;
+  if (list->tail == -1)
+    list->tail = i;
+  list->len++;
+}
+
+/* LRU: one recency list, evicted from the least recently used end. */
+static void lru_admit(cache_shard_t *s, int i, int key) {
+  list_push_front(&s->lists[Q_A1IN], i);
+}
+
+static void lru_touch(cache_shard_t *s, int i) {
+  list_unlink(&s->lists[Q_A1IN], i);
+  list_push_front(&s->lists[Q_A1IN], i);
+}
+
+static int lru_victim(cache_shard_t *s) {
+  return s->lists[Q_A1IN].tail;
+}
+
+static void lru_evict(cache_shard_t *s, int i) {
+  list_unlink(&s->lists[Q_A1IN], i);
+}
+
+/* CLOCK: a use only sets a bit, so hits take no list work. The hand sweeps
+ * the slots in order, clearing the bits it passes, and takes the first entry
+ * whose bit is already clear. A new entry starts clear and has until the hand
+ * comes round again to be used. */
+static void clock_admit(cache_shard_t *s, int i, int key) {
+  cache[i].referenced = false;
+}
+
+static void clock_touch(cache_shard_t *s, int i) {
+  cache[i].referenced = true;
+}
+
+static int clock_victim(cache_shard_t *s) {
+  for (;;) {
+    int i = s->base + s->hand;
+    s->hand = (s->hand + 1) % s->size;
+    // Slots not used yet, or emptied to free a body, hold nothing to evict
+    if (!cache[i].valid) {
+      continue;
+    }
+    if (!cache[i].referenced) {
+      return i;
+    }
+    cache[i].referenced = false;
+  }
+}
+
+static void clock_evict(cache_shard_t *s, int i) {
+}
+
+/* 2Q: remembers |key| as recently evicted from A1in, forgetting the oldest
+ * key when the ring is full. A key that was cached again since it went on the
+ * ring no longer maps to its position, and is left alone. */
+static void ghost_push(cache_shard_t *s, int key) {
+  if (s->ghost_count == s->ghost_size) {
+    int old = s->ghosts[s->ghost_head];
+    if (cache_index[old] == GHOST(s->ghost_head)) {
+      cache_index[old] = -1;
+    }
+    s->ghost_head = (s->ghost_head + 1) % s->ghost_size;
+    s->ghost_count--;
+  }
+  int pos = (s->ghost_head + s->ghost_count) % s->ghost_size;
+  s->ghosts[pos] = key;
+  cache_index[key] = GHOST(pos);
+  s->ghost_count++;
+}
+
+/* 2Q: a block comes in on A1in, unless it was evicted from there recently
+ * enough to still be on A1out, which shows it is in regular use. */
+static void twoq_admit(cache_shard_t *s, int i, int key) {
+  cache[i].queue = cache_index[key] <= GHOST(0) ? Q_AM : Q_A1IN;
+  list_push_front(&s->lists[cache[i].queue], i);
+}
+
+/* 2Q: uses of a block on A1in are likely part of the same burst (a partial
+ * block write reads it first, say), so only Am keeps recency order. */
+static void twoq_touch(cache_shard_t *s, int i) {
+  if (cache[i].queue == Q_AM) {
+    list_unlink(&s->lists[Q_AM], i);
+    list_push_front(&s->lists[Q_AM], i);
+  }
+}
+
+static int twoq_victim(cache_shard_t *s) {
+  if (s->lists[Q_A1IN].len > s->a1in_max || s->lists[Q_AM].len == 0) {
+    return s->lists[Q_A1IN].tail;
+  }
+  return s->lists[Q_AM].tail;
+}
+
+static void twoq_evict(cache_shard_t *s, int i) {
+  list_unlink(&s->lists[cache[i].queue], i);
+  if (cache[i].queue == Q_A1IN) {
+    ghost_push(s, CACHE_KEY(cache[i].disk_num, cache[i].block_num));
+  }
+}
+
+static const cache_policy_ops_t policies[CACHE_NUM_POLICIES] = {
+  [CACHE_LRU] = { "lru", lru_admit, lru_touch, lru_victim, lru_evict },
+  [CACHE_CLOCK] = { "clock", clock_admit, clock_touch, clock_victim, clock_evict },
+  [CACHE_2Q] = { "2q", twoq_admit, twoq_touch, twoq_victim, twoq_evict },
+};
+
+/* Waits, with shard |s| locked, until no evicted entry for |key| is on its
+ * way to the server: until then the server may not have the block yet, while
+ * the cache no longer has it. */
+static void wait_written_back(cache_shard_t *s, int key) {
+  while (writing_back[key]) {
+    pthread_cond_wait(&s->written_back, &s->lock);
+  }
+}
+
+/* Locks and returns the shard that owns |disk_num| and |block_num|, or returns
+ * NULL if the cache is disabled or the pair is out of range. */
+static cache_shard_t *lock_shard(int disk_num, int block_num) {
+  if (!cache_enabled() || disk_num < 0 || disk_num >= JBOD_NUM_DISKS ||
+      block_num < 0 || block_num >= JBOD_NUM_BLOCKS_PER_DISK) {
+    return NULL;
+  }
+  cache_shard_t *s = SHARD_OF(CACHE_KEY(disk_num, block_num));
+  pthread_mutex_lock(&s->lock);
+  wait_written_back(s, CACHE_KEY(disk_num, block_num));
+  return s;
+}
+
+/* Returns the entry the policy evicts next from shard |s|, which must be
+ * locked, waiting while every entry is out being written back. */
+static int pick_victim(cache_shard_t *s) {
+  while (s->num_cached == 0) {
+    pthread_cond_wait(&s->written_back, &s->lock);
+  }
+  return ops->victim(s);
+}
+
+/* Returns the slot holding |disk_num| and |block_num|, or -1 if it is not
+ * cached. The pair must be in range and its shard locked. */
+static int cache_find(int disk_num, int block_num) {
+  int i = cache_index[CACHE_KEY(disk_num, block_num)];
+  return i >= 0 ? i : -1;
+}
+
+int cache_set_policy(cache_policy_t new_policy) {
+  if (cache_enabled() || new_policy < 0 || new_policy >= CACHE_NUM_POLICIES) {
+    return -1;
+  }
+  policy = new_policy;
+  return 1;
+}
+
+const char *cache_policy_name(cache_policy_t p) {
+  return (p >= 0 && p < CACHE_NUM_POLICIES) ? policies[p].name : "unknown";
+}
 
 int cache_create(int num_entries) {
+  return cache_create_sharded(num_entries, 1);
+}
+
+static void slab_reset(cache_shard_t *s);
+
+/* Empties the cache: every key maps to no slot and the shards have no entries
+ * and nothing to remember. */
+static void clear_entries(void) {
+  memset(cache, 0, cache_size * sizeof(cache_entry_t));
+  for (int k = 0; k < CACHE_NUM_KEYS; k++) {
+    cache_index[k] = -1;
+  }
+  for (int i = 0; i < num_shards; i++) {
+    cache_shard_t *s = &shards[i];
+    s->num_used = 0;
+    s->num_cached = 0;
+    s->free_slot = -1;
+    // Every body is free, as is the slab, and no bucket has any
+    s->free_body = -1;
+    for (int b = s->body_base + s->num_bodies - 1; b >= s->body_base; b--) {
+      bodies[b].refs = 0;
+      bodies[b].next = s->free_body;
+      s->free_body = b;
+    }
+    s->bodies_used = 0;
+    slab_reset(s);
+    for (int h = 0; h < s->num_buckets; h++) {
+      s->buckets[h] = -1;
+    }
+    for (int q = 0; q < 2; q++) {
+      s->lists[q] = (cache_list_t){ -1, -1, 0 };
+    }
+    s->hand = 0;
+    s->ghost_head = 0;
+    s->ghost_count = 0;
+  }
+  if (l2_valid != NULL) {
+    memset(l2_valid, 0, CACHE_NUM_KEYS * sizeof(bool));
+  }
+}
+
+static int insert_locked(cache_shard_t *s, int disk_num, int block_num, const uint8_t *buf);
+static void update_locked(cache_shard_t *s, int i, const uint8_t *buf);
+
+int cache_set_dedup(bool enabled) {
+  if (cache_enabled()) {
+    return -1;
+  }
+  dedup = enabled;
+  return 1;
+}
+
+int cache_set_compression(bool enabled) {
+  if (cache_enabled()) {
+    return -1;
+  }
+  compress = enabled;
+  return 1;
+}
+
+/* Packs the block |data| into |p| the way a body stores it. With compression
+ * on, a block of one repeated byte packs to nothing but the byte, the common
+ * case and the fast one; any other is compressed PackBits style, into runs
+ * that start with a control byte n: below 128, n + 1 literal bytes follow,
+ * otherwise one byte repeated n - 125 times. A block that would not shrink,
+ * or any block with compression off, is kept as is. */
+static void pack(const uint8_t *data, packed_t *p) {
+  p->bytes = data;
+  p->len = JBOD_BLOCK_SIZE;
+  p->fill = 0;
+  if (!compress) {
+    return;
+  }
+  if (memcmp(data, data + 1, JBOD_BLOCK_SIZE - 1) == 0) {
+    p->len = 0;
+    p->fill = data[0];
+    return;
+  }
+
+  int len = 0, lit = -1; // lit: the control byte of the literal run being added to
+  for (int i = 0; i < JBOD_BLOCK_SIZE;) {
+    int run = 1;
+    while (i + run < JBOD_BLOCK_SIZE && run < 130 && data[i + run] == data[i]) {
+      run++;
+    }
+    // Stop as soon as the block would not shrink; p still holds it as is
+    if (run >= 3) {
+      if (len + 2 >= JBOD_BLOCK_SIZE) {
+        return;
+      }
+      p->buf[len++] = run + 125;
+      p->buf[len++] = data[i];
+      i += run;
+      lit = -1;
+    } else if (lit == -1 || p->buf[lit] == 127) {
+      if (len + 2 >= JBOD_BLOCK_SIZE) {
+        return;
+      }
+      lit = len++;
+      p->buf[lit] = 0;
+      p->buf[len++] = data[i++];
+    } else {
+      if (len + 1 >= JBOD_BLOCK_SIZE) {
+        return;
+      }
+      p->buf[lit]++;
+      p->buf[len++] = data[i++];
+    }
+  }
+  p->bytes = p->buf;
+  p->len = len;
+}
+
+/* Writes the block body |b| holds into |out|, unpacking it. */
+static void body_read(int b, uint8_t *out) {
+  const cache_body_t *body = &bodies[b];
+  const uint8_t *in = slab + body->off;
+  if (body->len == 0) {
+    memset(out, body->fill, JBOD_BLOCK_SIZE);
+  } else if (body->len == JBOD_BLOCK_SIZE) {
+    memcpy(out, in, JBOD_BLOCK_SIZE);
+  } else {
+    for (int i = 0, o = 0; i < body->len;) {
+      int n = in[i++];
+      if (n < 128) {
+        memcpy(out + o, in + i, n + 1);
+        o += n + 1;
+        i += n + 1;
+      } else {
+        memset(out + o, in[i++], n - 125);
+        o += n - 125;
+      }
+    }
+  }
+}
+
+/* Returns true if body |b| holds the block packed into |p|. Packing is
+ * deterministic, so equal blocks pack the same. */
+static bool body_holds(int b, const packed_t *p) {
+  const cache_body_t *body = &bodies[b];
+  if (body->len != p->len) {
+    return false;
+  }
+  return p->len == 0 ? body->fill == p->fill : memcmp(slab + body->off, p->bytes, p->len) == 0;
+}
+
+/* Returns the slab bytes a block packed into |len| bytes takes. */
+static int chunk_size(int len) {
+  return (len + SLAB_CHUNK - 1) / SLAB_CHUNK * SLAB_CHUNK;
+}
+
+/* Returns the chunk at |off|, of |size| bytes, to the slab of shard |s|. The
+ * free chunks of each size are linked through their first bytes. */
+static void slab_free(cache_shard_t *s, uint32_t off, int size) {
+  int c = size / SLAB_CHUNK - 1;
+  memcpy(slab + off, &s->free_chunks[c], sizeof(uint32_t));
+  s->free_chunks[c] = off;
+}
+
+/* Returns the offset of a chunk of |size| bytes from the slab of shard |s|,
+ * or SLAB_NONE if there is none: a free chunk of that size, else the front of
+ * a larger one, else the part of the slab never handed out yet. */
+static uint32_t slab_alloc(cache_shard_t *s, int size) {
+  for (int c = size / SLAB_CHUNK - 1; c < SLAB_CLASSES; c++) {
+    uint32_t off = s->free_chunks[c];
+    if (off == SLAB_NONE) {
+      continue;
+    }
+    memcpy(&s->free_chunks[c], slab + off, sizeof(uint32_t));
+    if ((c + 1) * SLAB_CHUNK > size) {
+      slab_free(s, off + size, (c + 1) * SLAB_CHUNK - size);
+    }
+    return off;
+  }
+  if (s->slab_used + size > s->slab_size) {
+    return SLAB_NONE;
+  }
+  s->slab_used += size;
+  return s->slab_base + s->slab_used - size;
+}
+
+/* Makes the whole slab of shard |s|, which must have no body in use, free
+ * again. Chunks are never merged, so this is what undoes fragmentation. */
+static void slab_reset(cache_shard_t *s) {
+  s->slab_used = 0;
+  for (int c = 0; c < SLAB_CLASSES; c++) {
+    s->free_chunks[c] = SLAB_NONE;
+  }
+}
+
+/* Returns the hash of a block's contents, FNV-1a over its 64-bit words. */
+static uint32_t body_hash(const uint8_t *data) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (int w = 0; w < JBOD_BLOCK_SIZE; w += sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, data + w, sizeof(word));
+    h = (h ^ word) * 0x100000001b3ULL;
+  }
+  return (uint32_t) (h ^ (h >> 32));
+}
+
+/* Returns the body of shard |s| holding the block packed into |p|, whose
+ * contents hash to |hash|, or -1. */
+static int body_find(cache_shard_t *s, const packed_t *p, uint32_t hash) {
+  for (int b = s->buckets[hash & (s->num_buckets - 1)]; b != -1; b = bodies[b].next) {
+    if (bodies[b].hash == hash && body_holds(b, p)) {
+      return b;
+    }
+  }
+  return -1;
+}
+
+/* Stores the block packed into |p| in body |b| of shard |s|, in the chunk of
+ * |cap| bytes at |off|, and, when deduplicating, files the body in its bucket
+ * by |hash|. */
+static void body_store(cache_shard_t *s, int b, const packed_t *p, uint32_t off, int cap, uint32_t hash) {
+  cache_body_t *body = &bodies[b];
+  body->len = p->len;
+  body->fill = p->fill;
+  body->off = off;
+  body->cap = cap;
+  memcpy(slab + off, p->bytes, p->len);
+  if (s->buckets != NULL) {
+    int *head = &s->buckets[hash & (s->num_buckets - 1)];
+    body->hash = hash;
+    body->next = *head;
+    *head = b;
+  }
+}
+
+/* Takes body |b| of shard |s| out of its bucket, when deduplicating. */
+static void body_unhash(cache_shard_t *s, int b) {
+  if (s->buckets == NULL) {
+    return;
+  }
+  int *link = &s->buckets[bodies[b].hash & (s->num_buckets - 1)];
+  while (*link != b) {
+    link = &bodies[*link].next;
+  }
+  *link = bodies[b].next;
+}
+
+/* Takes a free body of shard |s| and stores the block packed into |p| in it,
+ * if there is one and room in the slab; returns the body, or -1. */
+static int body_new(cache_shard_t *s, const packed_t *p, uint32_t hash) {
+  int size = chunk_size(p->len);
+  uint32_t off = 0;
+  if (s->free_body == -1 || (size > 0 && (off = slab_alloc(s, size)) == SLAB_NONE)) {
+    return -1;
+  }
+  int b = s->free_body;
+  s->free_body = bodies[b].next;
+  bodies[b].refs = 1;
+  s->bodies_used++;
+  body_store(s, b, p, off, size, hash);
+  return b;
+}
+
+/* Drops a reference to body |b| of shard |s|; with the last one it is free,
+ * and so is its chunk. */
+static void body_release(cache_shard_t *s, int b) {
+  if (--bodies[b].refs > 0) {
+    return;
+  }
+  body_unhash(s, b);
+  if (bodies[b].cap > 0) {
+    slab_free(s, bodies[b].off, bodies[b].cap);
+  }
+  bodies[b].next = s->free_body;
+  s->free_body = b;
+  s->bodies_used--;
+}
+
+/* Evicts the entry in slot |i| of shard |s|, writing it back first if it is
+ * dirty and, with an L2, demoting it there. The entry leaves the index and
+ * the policy first, so the slot is the caller's alone. A write-back goes to
+ * the server with the shard unlocked, so other keys of the shard are not held
+ * up for a round trip; calls for the victim's key wait for it to end (see
+ * lock_shard), and the caller must allow for the shard having changed. Returns
+ * 1 on success and -1 if the write-back failed, putting the entry back. */
+static int evict_locked(cache_shard_t *s, int i) {
+  int victim_key = CACHE_KEY(cache[i].disk_num, cache[i].block_num);
+  cache_index[victim_key] = -1;
+  ops->evict(s, i);
+  cache[i].valid = false;
+  s->num_cached--;
+
+  // A dirty victim must reach the server before its slot is reused.
+  if (cache[i].dirty) {
+    uint8_t block[JBOD_BLOCK_SIZE];
+    body_read(cache[i].body, block);
+    writing_back[victim_key] = true;
+    pthread_mutex_unlock(&s->lock);
+    int rc = writeback(cache[i].disk_num, cache[i].block_num, block);
+    pthread_mutex_lock(&s->lock);
+    writing_back[victim_key] = false;
+    pthread_cond_broadcast(&s->written_back);
+    if (rc != 1) {
+      // Still dirty, for a later eviction or flush to retry
+      cache[i].valid = true;
+      ops->admit(s, i, victim_key);
+      cache_index[victim_key] = i;
+      s->num_cached++;
+      return -1;
+    }
+    num_writebacks++;
+  }
+  num_evictions++;
+  if (cache[i].prefetched) {
+    num_prefetch_wasted++;
+  }
+  // The victim, clean by now, is demoted to L2 rather than dropped.
+  if (l2 != NULL) {
+    body_read(cache[i].body, l2[victim_key]);
+    l2_valid[victim_key] = true;
+    num_demotions++;
+  }
+  body_release(s, cache[i].body);
+  cache[i].dirty = false;
+  cache[i].prefetched = false;
+  return 1;
+}
+
+/* Returns a body of shard |s| holding the block packed into |p|, whose
+ * contents hash to |hash|, with a reference taken for the caller: when
+ * deduplicating, one that holds it already if there is one, otherwise a new
+ * one. Without a free body or room in the slab for it, entries are evicted,
+ * in the order the policy picks them, until there is; their slots go on the
+ * free list. Returns -1 if a dirty entry could not be written back. */
+static int body_acquire(cache_shard_t *s, const packed_t *p, uint32_t hash) {
+  int b = s->buckets != NULL ? body_find(s, p, hash) : -1;
+  if (b != -1) {
+    bodies[b].refs++;
+    num_dedup_hits++;
+    return b;
+  }
+  while ((b = body_new(s, p, hash)) == -1) {
+    // With no body in use, what keeps the slab from having room is fragmentation
+    if (s->bodies_used == 0) {
+      slab_reset(s);
+      continue;
+    }
+    int i = pick_victim(s);
+    if (evict_locked(s, i) == -1) {
+      return -1;
+    }
+    cache[i].next = s->free_slot;
+    s->free_slot = i;
+  }
+  return b;
+}
+
+/* Inserts the records of the snapshot file, oldest first, so the policy ends
+ * up ordering them as it did when they were saved. A missing or unusable file
+ * leaves the cache cold. */
+static void restore_snapshot(void) {
+  int fd = open(snapshot_path, O_RDONLY);
+  if (fd == -1) {
+    return;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == -1 || st.st_size < (off_t) sizeof(snapshot_header_t)) {
+    close(fd);
+    return;
+  }
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return;
+  }
+
+  // A snapshot of another geometry, or cut short, is of no use
+  const snapshot_header_t *header = map;
+  const snapshot_record_t *records = (const snapshot_record_t *) (header + 1);
+  if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) == 0 &&
+      header->num_disks == JBOD_NUM_DISKS && header->blocks_per_disk == JBOD_NUM_BLOCKS_PER_DISK &&
+      header->block_size == JBOD_BLOCK_SIZE &&
+      (uint64_t) st.st_size == sizeof(*header) + (uint64_t) header->num_entries * sizeof(*records)) {
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    // Only the newest cache_size records can stay, so the older ones are skipped
+    uint32_t first = header->num_entries > (uint32_t) cache_size ? header->num_entries - cache_size : 0;
+    for (uint32_t r = first; r < header->num_entries; r++) {
+      int disk_num = records[r].disk_num, block_num = records[r].block_num;
+      if (disk_num < 0 || disk_num >= JBOD_NUM_DISKS || block_num < 0 || block_num >= JBOD_NUM_BLOCKS_PER_DISK) {
+        continue;
+      }
+      cache_shard_t *s = SHARD_OF(CACHE_KEY(disk_num, block_num));
+      pthread_mutex_lock(&s->lock);
+      if (insert_locked(s, disk_num, block_num, records[r].block) != -1) {
+        num_restored++;
+        snapshot_unchecked = true;
+      }
+      pthread_mutex_unlock(&s->lock);
+    }
+  }
+  munmap(map, st.st_size);
+}
+
+/* Writes entry |i| to the snapshot |f| if it holds what the volume does, and
+ * counts it in |header|; returns false if the write failed. */
+static bool save_entry(FILE *f, int i, snapshot_header_t *header) {
+  if (!cache[i].valid || cache[i].dirty) {
+    return true;
+  }
+  snapshot_record_t record = { .disk_num = cache[i].disk_num, .block_num = cache[i].block_num };
+  body_read(cache[i].body, record.block);
+  header->num_entries++;
+  return fwrite(&record, sizeof(record), 1, f) == 1;
+}
+
+/* Saves the clean entries to the snapshot file, each shard's oldest first: the
+ * recency lists from their least recently used ends, A1in before Am, or for
+ * CLOCK, which keeps no lists, the slots from the hand round. The file is
+ * written beside the old one and renamed over it, so a failed save leaves the
+ * old one whole. Returns 1 on success and -1 on failure. */
+static int save_snapshot(void) {
+  char tmp_path[PATH_MAX + 4];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", snapshot_path);
+  FILE *f = fopen(tmp_path, "wb");
+  if (f == NULL) {
+    return -1;
+  }
+
+  // The header goes in last, once the number of entries is known
+  snapshot_header_t header = { .num_disks = JBOD_NUM_DISKS, .blocks_per_disk = JBOD_NUM_BLOCKS_PER_DISK,
+                               .block_size = JBOD_BLOCK_SIZE, .num_entries = 0 };
+  memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+  bool ok = fseek(f, sizeof(header), SEEK_SET) == 0;
+  for (int j = 0; j < num_shards && ok; j++) {
+    cache_shard_t *s = &shards[j];
+    if (s->lists[Q_A1IN].len + s->lists[Q_AM].len > 0) {
+      for (int q = Q_A1IN; q <= Q_AM && ok; q++) {
+        for (int i = s->lists[q].tail; i != -1 && ok; i = cache[i].prev) {
+          ok = save_entry(f, i, &header);
+        }
+      }
+    } else {
+      for (int k = 0; k < s->size && ok; k++) {
+        ok = save_entry(f, s->base + (s->hand + k) % s->size, &header);
+      }
+    }
+  }
+  ok = ok && fseek(f, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, f) == 1;
+
+  if (fclose(f) != 0 || !ok || rename(tmp_path, snapshot_path) == -1) {
+    unlink(tmp_path);
+    return -1;
+  }
+  return 1;
+}
+
+int cache_set_l2(const char *path) {
+  if (cache_enabled() || (path != NULL && strlen(path) >= sizeof(l2_path))) {
+    return -1;
+  }
+  snprintf(l2_path, sizeof(l2_path), "%s", path ? path : "");
+  return 1;
+}
+
+/* Maps the L2 file, sized to hold every block, and marks it empty. Returns 1
+ * on success and -1 on failure. */
+static int open_l2(void) {
+  int fd = open(l2_path, O_RDWR | O_CREAT, 0600);
+  if (fd == -1) {
+    return -1;
+  }
+  if (ftruncate(fd, (off_t) CACHE_NUM_KEYS * JBOD_BLOCK_SIZE) == -1) {
+    close(fd);
+    return -1;
+  }
+  void *map = mmap(NULL, (size_t) CACHE_NUM_KEYS * JBOD_BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  l2_valid = calloc(CACHE_NUM_KEYS, sizeof(bool));
+  if (map == MAP_FAILED || l2_valid == NULL) {
+    if (map != MAP_FAILED) {
+      munmap(map, (size_t) CACHE_NUM_KEYS * JBOD_BLOCK_SIZE);
+    }
+    free(l2_valid);
+    l2_valid = NULL;
+    return -1;
+  }
+  l2 = map;
+  return 1;
+}
+
+/* Unmaps the L2 file; what it held is forgotten. */
+static void close_l2(void) {
+  if (l2 != NULL) {
+    munmap(l2, (size_t) CACHE_NUM_KEYS * JBOD_BLOCK_SIZE);
+  }
+  free(l2_valid);
+  l2 = NULL;
+  l2_valid = NULL;
+}
+
+int cache_set_snapshot(const char *path) {
+  if (cache_enabled() || (path != NULL && strlen(path) >= sizeof(snapshot_path))) {
+    return -1;
+  }
+  snprintf(snapshot_path, sizeof(snapshot_path), "%s", path ? path : "");
+  return 1;
+}
+
+int cache_validate_snapshot(cache_read_fn read) {
+  if (!cache_enabled() || !snapshot_unchecked) {
+    return 1;
+  }
+  snapshot_unchecked = false;
+
+  // Read back every restored entry in one batch; one that differs means the
+  // volume changed since the snapshot, and none of it can be trusted
+  int n = 0;
+  int *disk_nums = malloc(cache_size * sizeof(int));
+  int *block_nums = malloc(cache_size * sizeof(int));
+  int *slots = malloc(cache_size * sizeof(int));
+  uint8_t *bufs = malloc((size_t) cache_size * JBOD_BLOCK_SIZE);
+  bool stale = disk_nums == NULL || block_nums == NULL || slots == NULL || bufs == NULL;
+  for (int i = 0; !stale && i < cache_size; i++) {
+    if (cache[i].valid) {
+      disk_nums[n] = cache[i].disk_num;
+      block_nums[n] = cache[i].block_num;
+      slots[n++] = i;
+    }
+  }
+  if (!stale && n > 0 && read(n, disk_nums, block_nums, bufs) != 1) {
+    stale = true;
+  }
+  for (int i = 0; !stale && i < n; i++) {
+    uint8_t block[JBOD_BLOCK_SIZE];
+    body_read(cache[slots[i]].body, block);
+    stale = memcmp(bufs + (size_t) i * JBOD_BLOCK_SIZE, block, JBOD_BLOCK_SIZE) != 0;
+  }
+  free(disk_nums);
+  free(block_nums);
+  free(slots);
+  free(bufs);
+
+  if (stale) {
+    num_restored_stale += num_restored;
+    clear_entries();
+    return -1;
+  }
+  return 1;
+}
+
+int cache_create_sharded(int num_entries, int shard_count) {
   // Validate the number of entries; it must be between 2 and 4096. Return -1 if invalid.
   if (num_entries < 2 || num_entries > 4096 || cache_enabled()) {
     return -1;
   }
+  // Every shard needs room for at least two entries.
+  if (shard_count < 1 || shard_count > CACHE_MAX_SHARDS || num_entries < 2 * shard_count) {
+    return -1;
+  }
   // Return -1 if cache is already initialized to prevent reinitialization.
   if (cache!=NULL){
     return -1;
   }
-  // Allocate memory for the cache using calloc and update cache_size, then return 1 to indicate success.
-  else{
-    cache = calloc(num_entries, sizeof(cache_entry_t));
-    cache_size=num_entries;
-    return 1;
+  // The slab has room for as many blocks as entries asked for, as they are.
+  // Deduplicating, entries with the same contents share a body, and
+  // compressing, blocks take less room, so there are more slots than that;
+  // compressing, a body for each.
+  int slots_per_block = compress ? CACHE_COMPRESS_SLOTS_PER_BLOCK : dedup ? CACHE_DEDUP_SLOTS_PER_BODY : 1;
+  int num_slots = num_entries * slots_per_block < CACHE_NUM_KEYS ? num_entries * slots_per_block : CACHE_NUM_KEYS;
+  int num_bodies = compress ? num_slots : num_entries;
+  // Each shard has a bucket for every body, rounded up to a power of two.
+  int num_buckets = 1;
+  while (num_buckets < num_bodies / shard_count + 1) {
+    num_buckets *= 2;
+  }
+  // Allocate memory for the cache and its index, then return 1 to indicate success.
+  // 2Q also remembers up to half as many recently evicted keys as there are slots.
+  cache = calloc(num_slots, sizeof(cache_entry_t));
+  cache_index = malloc(CACHE_NUM_KEYS * sizeof(int));
+  bodies = malloc(num_bodies * sizeof(cache_body_t));
+  slab = malloc((size_t) num_entries * JBOD_BLOCK_SIZE);
+  body_buckets = dedup ? malloc(shard_count * num_buckets * sizeof(int)) : NULL;
+  ghost_keys = (policy == CACHE_2Q) ? malloc(num_slots * sizeof(int)) : NULL;
+  writing_back = calloc(CACHE_NUM_KEYS, sizeof(bool));
+  if (cache == NULL || cache_index == NULL || bodies == NULL || slab == NULL || (dedup && body_buckets == NULL) ||
+      writing_back == NULL ||
+      (policy == CACHE_2Q && ghost_keys == NULL) || (l2_path[0] != '\0' && open_l2() == -1)) {
+    close_l2();
+    free(cache);
+    free(cache_index);
+    free(bodies);
+    free(slab);
+    free(body_buckets);
+    free(ghost_keys);
+    free(writing_back);
+    cache = NULL;
+    cache_index = NULL;
+    bodies = NULL;
+    slab = NULL;
+    body_buckets = NULL;
+    ghost_keys = NULL;
+    writing_back = NULL;
+    return -1;
+  }
+  // Share the slots, bodies and slab out between the shards as evenly as possible.
+  int base = 0, body_base = 0;
+  uint32_t slab_base = 0;
+  for (int i = 0; i < shard_count; i++) {
+    cache_shard_t *s = &shards[i];
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->written_back, NULL);
+    s->base = base;
+    s->size = num_slots / shard_count + (i < num_slots % shard_count);
+    s->body_base = body_base;
+    s->num_bodies = num_bodies / shard_count + (i < num_bodies % shard_count);
+    s->slab_base = slab_base;
+    s->slab_size = (num_entries / shard_count + (i < num_entries % shard_count)) * JBOD_BLOCK_SIZE;
+    s->buckets = body_buckets ? body_buckets + i * num_buckets : NULL;
+    s->num_buckets = body_buckets ? num_buckets : 0;
+    // 2Q gives a quarter of the slots to A1in, as its authors suggest
+    s->a1in_max = s->size / 4 > 0 ? s->size / 4 : 1;
+    s->ghosts = ghost_keys ? ghost_keys + base : NULL;
+    s->ghost_size = s->size / 2;
+    base += s->size;
+    body_base += s->num_bodies;
+    slab_base += s->slab_size;
   }
+  ops = &policies[policy];
+  num_shards = shard_count;
+  cache_size = num_slots;
+  // Nothing is cached yet: every key maps to no slot and the recency lists are
+  // empty, until the snapshot, if there is one, warms the cache up.
+  clear_entries();
+  snapshot_unchecked = false;
+  if (snapshot_path[0] != '\0') {
+    restore_snapshot();
+  }
+  return 1;
 }
 
 int cache_destroy(void) {
   if (cache == NULL) {
     return -1; // Return -1 indicating failure as there's no cache to destroy.
   }
-  free(cache); // Release the allocated memory for the cache.
+  // Save the entries for the next cache_create before they go.
+  int rc = snapshot_path[0] != '\0' ? save_snapshot() : 1;
+  // Read-ahead blocks nobody got to were wasted. What the entries left share
+  // tells how well deduplication did.
+  dedup_entries = 0;
+  dedup_bodies = 0;
+  compressed_bytes = 0;
+  fill_blocks = 0;
+  for (int j = 0; j < num_shards; j++) {
+    for (int i = shards[j].base; i < shards[j].base + shards[j].num_used; i++) {
+      if (cache[i].prefetched) {
+        num_prefetch_wasted++;
+      }
+      dedup_entries += cache[i].valid;
+    }
+    for (int b = shards[j].body_base; b < shards[j].body_base + shards[j].num_bodies; b++) {
+      if (bodies[b].refs > 0) {
+        dedup_bodies++;
+        compressed_bytes += bodies[b].cap;
+        fill_blocks += bodies[b].len == 0;
+      }
+    }
+    pthread_mutex_destroy(&shards[j].lock);
+    pthread_cond_destroy(&shards[j].written_back);
+  }
+  compressed_blocks = dedup_bodies;
+  close_l2();
+  free(cache); // Release the allocated memory for the cache and its index.
+  free(cache_index);
+  free(bodies);
+  free(slab);
+  free(body_buckets);
+  free(ghost_keys);
+  free(writing_back);
   cache = NULL;
+  cache_index = NULL;
+  bodies = NULL;
+  slab = NULL;
+  body_buckets = NULL;
+  ghost_keys = NULL;
+  writing_back = NULL;
   cache_size=0;
-  return 1; // Return 1 indicating successful destruction of the cache.
+  num_shards = 0;
+  return rc; // Return 1 indicating successful destruction of the cache, and the snapshot saved.
 }
 
 int cache_lookup(int disk_num, int block_num, uint8_t *buf) {
     // Increment the total number of queries made to the cache.
     num_queries++;
-    
+
     // Early return if cache is not enabled, the buffer pointer is null, or indices are out of bounds.
-    if (!cache_enabled() || buf == NULL || disk_num < 0 || disk_num >= 16 || block_num < 0 || block_num >= 256) {
+    if (buf == NULL) {
+        return -1;
+    }
+    cache_shard_t *s = lock_shard(disk_num, block_num);
+    if (s == NULL) {
         return -1;
     }
 
-    // Search through the cache for an entry matching the disk and block numbers.
-    for (int i = 0; i < cache_size; ++i) {
-        if (cache[i].valid && cache[i].disk_num == disk_num && cache[i].block_num == block_num) {
-            // A matching entry has been found: copy its contents to the provided buffer.
-            memcpy(buf, cache[i].block, JBOD_BLOCK_SIZE);
-            // Update this entry's last accessed time to maintain LRU order.
-            cache[i].access_time = ++clock;
-            // Record a successful hit.
-            num_hits++;
-            // Return success as the requested block was found and copied.
-            return 1;
+    // Look the entry up in the index; a miss means the block was not found in the cache.
+    int i = cache_find(disk_num, block_num);
+    if (i == -1) {
+        // Missing from L1, the block may still be in L2, which saves the trip
+        // to the server; it goes back up to L1 as it is used again.
+        int key = CACHE_KEY(disk_num, block_num);
+        if (l2_valid == NULL || !l2_valid[key]) {
+            pthread_mutex_unlock(&s->lock);
+            return -1;
         }
+        memcpy(buf, l2[key], JBOD_BLOCK_SIZE);
+        insert_locked(s, disk_num, block_num, l2[key]);
+        pthread_mutex_unlock(&s->lock);
+        num_l2_hits++;
+        num_hits++;
+        return 1;
     }
 
-    // The requested block was not found in the cache.
-    return -1;
+    // A matching entry has been found: copy its contents to the provided buffer.
+    body_read(cache[i].body, buf);
+    // The first use of a read-ahead block is what made reading it ahead worthwhile.
+    if (cache[i].prefetched) {
+        cache[i].prefetched = false;
+        num_prefetch_hits++;
+    }
+    // Let the replacement policy know the entry was used.
+    ops->touch(s, i);
+    pthread_mutex_unlock(&s->lock);
+    // Record a successful hit.
+    num_hits++;
+    // Return success as the requested block was found and copied.
+    return 1;
 }
 
 void cache_update(int disk_num, int block_num, const uint8_t *buf) {
-  if (cache == NULL || buf == NULL ) {
+  if (buf == NULL ) {
     return;
   }
-
-  // Iterate through the cache to find an existing entry to update.
-  for (int i = 0; i < cache_size; i++) {
-    // Check if the current entry is valid and matches the disk and block numbers.
-    if (cache[i].valid && cache[i].disk_num == disk_num && cache[i].block_num == block_num) {
-      memcpy(cache[i].block, buf, JBOD_BLOCK_SIZE);
-      // Update the access time of this cache entry and increment the global clock.
-      clock++;
-      cache[i].access_time = clock;
-      cache[i].valid = true;
-      return;
-    }
+  cache_shard_t *s = lock_shard(disk_num, block_num);
+  if (s == NULL) {
+    return;
   }
 
+  // Find the existing entry to update; nothing to do if the block is not cached.
+  int i = cache_find(disk_num, block_num);
+  if (i != -1) {
+    update_locked(s, i, buf);
+  } else if (l2_valid != NULL && l2_valid[CACHE_KEY(disk_num, block_num)]) {
+    memcpy(l2[CACHE_KEY(disk_num, block_num)], buf, JBOD_BLOCK_SIZE);
+  }
+  pthread_mutex_unlock(&s->lock);
 }
 
-int cache_insert(int disk_num, int block_num, const uint8_t *buf) {
-    // Check cache state and input parameters.
-    if (!cache_enabled() || buf == NULL) {
-        return -1; // Return error if cache is not enabled or buffer is NULL.
+/* Inserts the block into shard |s|, which must be locked; returns the slot it
+ * went into, or -1. */
+static int insert_locked(cache_shard_t *s, int disk_num, int block_num, const uint8_t *buf) {
+    // An entry for this block already exists, return an error.
+    if (cache_find(disk_num, block_num) != -1) {
+        return -1;
     }
 
-    // Validate disk number range.
-    if (disk_num < 0 || disk_num > 15) {
-        return -1; // Return error on invalid disk number.
+    // Take a free slot while there is one, otherwise evict the entry the policy picks.
+    int i;
+    if (s->free_slot != -1) {
+        i = s->free_slot;
+        s->free_slot = cache[i].next;
+    } else if (s->num_used < s->size) {
+        i = s->base + s->num_used++;
+    } else {
+        i = pick_victim(s);
+        if (evict_locked(s, i) == -1) {
+            return -1;
+        }
     }
 
-    // Check block number range.
-    if (block_num < 0 || block_num > 255) {
-        return -1; // Return error on invalid block number.
+    // The contents need a body too, which may take evicting more entries.
+    packed_t packed;
+    pack(buf, &packed);
+    int b = body_acquire(s, &packed, s->buckets != NULL ? body_hash(buf) : 0);
+    if (b == -1) {
+        cache[i].next = s->free_slot;
+        s->free_slot = i;
+        return -1;
     }
 
-    int least_LRU = 0; // Index of the least recently used (LRU) entry.
-    // Iterate over cache entries to either find a matching entry or the LRU entry.
+    // A write-back along the way unlocked the shard, and another thread may
+    // have cached the block meanwhile.
+    if (cache_find(disk_num, block_num) != -1 || writing_back[CACHE_KEY(disk_num, block_num)]) {
+        body_release(s, b);
+        cache[i].next = s->free_slot;
+        s->free_slot = i;
+        return -1;
+    }
 
-    // Iterate over cache entries to either find a matching entry or the LRU entry.
-    for(int i = 0; i < cache_size; i++) {
-        // Check if entry matches the given disk and block numbers.
-        if (cache[i].valid && 
-          cache[i].disk_num == disk_num && 
-          cache[i].block_num == block_num) {
-          return -1; // Entry already exists, return an error.
-        }
+    // Fill in the slot and hand it to the policy, which may want to know
+    // whether the key was remembered before it maps to the slot.
+    cache[i].disk_num = disk_num;
+    cache[i].block_num = block_num;
+    cache[i].valid = true; // Mark the slot as valid.
+    cache[i].dirty = false;
+    cache[i].prefetched = false;
+    cache[i].body = b;
+    ops->admit(s, i, CACHE_KEY(disk_num, block_num));
+    cache_index[CACHE_KEY(disk_num, block_num)] = i;
+    s->num_cached++;
+    // L1 holds the block now, so any copy in L2 is out of date.
+    if (l2_valid != NULL) {
+        l2_valid[CACHE_KEY(disk_num, block_num)] = false;
+    }
 
-        // Update least_LRU if this entry is less recently used than the current LRU.
-        if (cache[i].access_time < cache[least_LRU].access_time) {
-            least_LRU = i;
-        }
+    return i; // Successful insertion.
+}
+
+/* Gives the entry in slot |i| of shard |s|, which must be locked, the contents
+ * |buf|, and counts that as a use. A body no other entry shares is rewritten
+ * in place if its chunk is big enough; a shared one is left to the others
+ * (copy-on-write). When the new contents need a body and there is no free one
+ * or no room for it, the entry is evicted and inserted afresh, so making room
+ * cannot take the entry itself. */
+static void update_locked(cache_shard_t *s, int i, const uint8_t *buf) {
+  int old = cache[i].body;
+  packed_t packed;
+  pack(buf, &packed);
+  if (body_holds(old, &packed)) {
+    ops->touch(s, i);
+    return;
+  }
+  uint32_t hash = s->buckets != NULL ? body_hash(buf) : 0;
+  int b = s->buckets != NULL ? body_find(s, &packed, hash) : -1;
+  if (b != -1) {
+    bodies[b].refs++;
+    num_dedup_hits++;
+  } else if (bodies[old].refs == 1 && chunk_size(packed.len) <= bodies[old].cap) {
+    // The body is the entry's alone and its chunk big enough
+    body_unhash(s, old);
+    body_store(s, old, &packed, bodies[old].off, bodies[old].cap, hash);
+    ops->touch(s, i);
+    return;
+  } else if ((b = body_new(s, &packed, hash)) == -1) {
+    // The old contents are superseded, so they need not be written back, and
+    // a failed insert must not leave them in L2 either.
+    int disk_num = cache[i].disk_num, block_num = cache[i].block_num;
+    cache[i].dirty = false;
+    evict_locked(s, i);
+    cache[i].next = s->free_slot;
+    s->free_slot = i;
+    if (insert_locked(s, disk_num, block_num, buf) == -1 && l2_valid != NULL) {
+      l2_valid[CACHE_KEY(disk_num, block_num)] = false;
     }
+    return;
+  }
+  body_release(s, old);
+  cache[i].body = b;
+  ops->touch(s, i);
+}
 
-    // Update or insert the cache entry at the least recently used slot.
-    cache[least_LRU].disk_num = disk_num;
-    cache[least_LRU].block_num = block_num;
-    cache[least_LRU].valid = true; // Mark the slot as valid.
-    memcpy(cache[least_LRU].block, buf, 256);
-    clock++;
-    cache[least_LRU].access_time = clock; // Update access time to current clock, increment clock.
+int cache_insert(int disk_num, int block_num, const uint8_t *buf) {
+  // Check cache state and input parameters; only a valid block has a shard.
+  if (buf == NULL) {
+    return -1;
+  }
+  cache_shard_t *s = lock_shard(disk_num, block_num);
+  if (s == NULL) {
+    return -1;
+  }
+  int i = insert_locked(s, disk_num, block_num, buf);
+  pthread_mutex_unlock(&s->lock);
+  if (i != -1) {
+    num_insertions++;
+  }
+  return i == -1 ? -1 : 1;
+}
+
+int cache_insert_prefetched(int disk_num, int block_num, const uint8_t *buf) {
+  if (buf == NULL) {
+    return -1;
+  }
+  cache_shard_t *s = lock_shard(disk_num, block_num);
+  if (s == NULL) {
+    return -1;
+  }
+  int i = insert_locked(s, disk_num, block_num, buf);
+  if (i != -1) {
+    cache[i].prefetched = true;
+    num_prefetched++;
+    num_insertions++;
+  }
+  pthread_mutex_unlock(&s->lock);
+  return i == -1 ? -1 : 1;
+}
+
+bool cache_contains(int disk_num, int block_num) {
+  cache_shard_t *s = lock_shard(disk_num, block_num);
+  if (s == NULL) {
+    return false;
+  }
+  bool found = cache_find(disk_num, block_num) != -1 ||
+               (l2_valid != NULL && l2_valid[CACHE_KEY(disk_num, block_num)]);
+  pthread_mutex_unlock(&s->lock);
+  return found;
+}
+
+void cache_set_write_back(cache_writeback_fn fn) {
+  writeback = fn;
+}
+
+bool cache_write_back_enabled(void) {
+  return cache_enabled() && writeback != NULL;
+}
+
+int cache_mark_dirty(int disk_num, int block_num) {
+  if (!cache_write_back_enabled()) {
+    return -1;
+  }
+
+  cache_shard_t *s = lock_shard(disk_num, block_num);
+  if (s == NULL) {
+    return -1;
+  }
+  int i = cache_find(disk_num, block_num);
+  if (i != -1) {
+    cache[i].dirty = true;
+  }
+  pthread_mutex_unlock(&s->lock);
+  return i == -1 ? -1 : 1;
+}
+
+int cache_flush(void) {
+  if (!cache_write_back_enabled()) {
+    return 1; // Nothing can be dirty in write-through mode.
+  }
 
-    return 1; // Successful insertion.
+  // Walking the index instead of the slots visits blocks in (disk, block)
+  // order, so the server sees the write-backs as sequential runs.
+  int rc = 1;
+  for (int k = 0; k < CACHE_NUM_KEYS; k++) {
+    cache_shard_t *s = SHARD_OF(k);
+    pthread_mutex_lock(&s->lock);
+    // A block evicted on its way to the server has to be there when this returns
+    wait_written_back(s, k);
+    int i = cache_index[k];
+    if (i >= 0 && cache[i].dirty) {
+      uint8_t block[JBOD_BLOCK_SIZE];
+      body_read(cache[i].body, block);
+      if (writeback(cache[i].disk_num, cache[i].block_num, block) == 1) {
+        cache[i].dirty = false;
+        num_writebacks++;
+      } else {
+        rc = -1; // Keep the entry dirty so a later flush can retry it.
+      }
+    }
+    pthread_mutex_unlock(&s->lock);
+  }
+  return rc;
 }
 
 bool cache_enabled(void) {
@@ -137,5 +1304,51 @@ bool cache_enabled(void) {
 }
 
 void cache_print_hit_rate(void) {
-  fprintf(stderr, "Hit rate: %5.1f%%\n", 100 * (float) num_hits / num_queries);
+  // Hits in L2 are counted among the misses of L1
+  fprintf(stderr, "Hit rate: %5.1f%% (%s)\n", 100 * (float) (num_hits - num_l2_hits) / num_queries,
+          cache_policy_name(policy));
+  if (num_demotions > 0) {
+    fprintf(stderr, "L2 hit rate: %5.1f%% of L1 misses, %5.1f%% overall (%d blocks demoted)\n",
+            100 * (float) num_l2_hits / (num_queries - num_hits + num_l2_hits),
+            100 * (float) num_hits / num_queries, (int) num_demotions);
+  }
+  if (num_prefetched > 0) {
+    fprintf(stderr, "Prefetched: %d blocks, %d hits, %d wasted\n",
+            (int) num_prefetched, (int) num_prefetch_hits, (int) num_prefetch_wasted);
+  }
+  if (dedup && dedup_bodies > 0) {
+    fprintf(stderr, "Dedup: %d entries in %d block bodies (%.2fx), %d shared\n", dedup_entries, dedup_bodies,
+            (float) dedup_entries / dedup_bodies, (int) num_dedup_hits);
+  }
+  if (compress && compressed_blocks > 0) {
+    fprintf(stderr, "Compression: %d blocks in %d slab bytes, %d of them of one repeated byte\n",
+            compressed_blocks, compressed_bytes, fill_blocks);
+  }
+  if (num_restored > 0) {
+    fprintf(stderr, "Restored: %d blocks from the snapshot%s\n", (int) num_restored,
+            num_restored_stale > 0 ? ", dropped as stale" : "");
+  }
+}
+
+void cache_get_stats(cache_stats_t *stats) {
+  stats->policy = policy;
+  stats->queries = num_queries;
+  stats->hits = num_hits;
+  stats->misses = stats->queries - stats->hits;
+  stats->insertions = num_insertions;
+  stats->evictions = num_evictions;
+  stats->writebacks = num_writebacks;
+  stats->prefetched = num_prefetched;
+  stats->prefetch_hits = num_prefetch_hits;
+  stats->prefetch_wasted = num_prefetch_wasted;
+  stats->restored = num_restored;
+  stats->restored_stale = num_restored_stale;
+  stats->l2_hits = num_l2_hits;
+  stats->demotions = num_demotions;
+  stats->dedup_hits = num_dedup_hits;
+  stats->dedup_entries = dedup_entries;
+  stats->dedup_bodies = dedup_bodies;
+  stats->compressed_blocks = compressed_blocks;
+  stats->compressed_bytes = compressed_bytes;
+  stats->fill_blocks = fill_blocks;
 }
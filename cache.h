@@ -9,39 +9,195 @@
 
 typedef struct {
   bool valid;
+  bool dirty; /* newer than the copy on the server; written back on eviction */
+  bool prefetched; /* read ahead and not looked up since */
   int disk_num;
   int block_num;
-  uint8_t block[JBOD_BLOCK_SIZE];
-  int access_time;
+  int body; /* the body holding the block's contents, shared by entries with
+               the same contents when deduplicating */
+  int prev; /* next more recently used entry, or -1 if this is the MRU */
+  int next; /* next less recently used entry, or -1 if this is the LRU */
+  int queue; /* 2Q: the recency list the entry is on */
+  bool referenced; /* CLOCK: used since the hand last passed it */
 } cache_entry_t;
 
+/* Replacement policies, which decide the entry a full cache evicts:
+ *   CACHE_LRU   - the least recently used entry (the default)
+ *   CACHE_CLOCK - an approximation of LRU that sweeps a hand over the
+ *                 entries, sparing those used since it last passed
+ *   CACHE_2Q    - new blocks wait on a short FIFO and only join the main LRU
+ *                 list when asked for again soon after leaving it, so a long
+ *                 sequential sweep cannot push out the blocks in regular use */
+typedef enum {
+  CACHE_LRU,
+  CACHE_CLOCK,
+  CACHE_2Q,
+  CACHE_NUM_POLICIES
+} cache_policy_t;
+
+/* Returns 1 on success and -1 on failure. Selects the replacement policy of
+ * the next cache created; fails if a cache exists or |policy| is unknown. */
+int cache_set_policy(cache_policy_t policy);
+
+/* Returns the short name of |policy| ("lru", "clock" or "2q"). */
+const char *cache_policy_name(cache_policy_t policy);
+
+/* Writes a dirty block back to the server; returns 1 on success and -1 on
+ * failure. */
+typedef int (*cache_writeback_fn)(int disk_num, int block_num, const uint8_t *buf);
+
 /* Returns 1 on success and -1 on failure. Should allocate a space for
  * |num_entries| cache entries, each of type cache_entry_t. Calling it again
  * without first calling cache_destroy (see below) should fail. */
 int cache_create(int num_entries);
 
+/* Most shards cache_create_sharded splits the entries into */
+#define CACHE_MAX_SHARDS 16
+
+/* Like cache_create, with the entries split into |num_shards| shards by
+ * (disk, block), each with its own lock and replacement state, so that threads rarely
+ * contend. Needs at least two entries per shard. cache_create uses one shard.
+ *
+ * Every cache call is safe to make from several threads at once, except
+ * cache_create, cache_create_sharded, cache_destroy, cache_set_policy and
+ * cache_set_write_back. */
+int cache_create_sharded(int num_entries, int num_shards);
+
 /* Returns 1 on success and -1 on failure. Frees the space allocated by
- * cache_create function above. */
+ * cache_create function above. Dirty entries are discarded, so call
+ * cache_flush first if write-back mode is on. With a snapshot file set, the
+ * clean entries are saved to it first; -1 then also means that failed. */
 int cache_destroy(void);
 
+/* Slots a deduplicating cache has for each block its memory holds */
+#define CACHE_DEDUP_SLOTS_PER_BODY 4
+
+/* Slots a compressing cache has for each block its memory holds */
+#define CACHE_COMPRESS_SLOTS_PER_BLOCK 8
+
+/* Returns 1 on success and -1 on failure. Turns deduplication on or off for
+ * the next cache created; fails if a cache exists. Deduplicating, entries
+ * with the same contents share one body, found by a hash of the contents, and
+ * an update leaves a shared body to the other entries (copy-on-write). The
+ * |num_entries| given to cache_create then counts bodies, the memory the
+ * blocks take, and there are up to CACHE_DEDUP_SLOTS_PER_BODY times as many
+ * slots, up to one per block of the volume. When a block needs a body and
+ * none is free, entries are evicted until one is. */
+int cache_set_dedup(bool enabled);
+
+/* Returns 1 on success and -1 on failure. Turns compression on or off for the
+ * next cache created; fails if a cache exists. Compressing, a block of one
+ * repeated byte takes no memory beyond its entry, and others are run-length
+ * encoded into chunks of a slab, in multiples of 16 bytes, if that makes
+ * them smaller. The cache is then sized in bytes: cache_create's
+ * |num_entries| times JBOD_BLOCK_SIZE of slab, with up to
+ * CACHE_COMPRESS_SLOTS_PER_BLOCK times as many slots, up to one per block of
+ * the volume. When a block does not fit, entries are evicted until it does.
+ * Combines with deduplication. */
+int cache_set_compression(bool enabled);
+
+/* Returns 1 on success and -1 on failure. Backs the next cache created with a
+ * second tier (L2) in the file |path|, mapped into memory, with room for every
+ * block of the volume: entries evicted from the cache are demoted to it, and
+ * a lookup that finds its block there promotes it back instead of missing. A
+ * block is in one tier at a time. The file is created if need be and starts
+ * out empty each time. NULL stops the tier. Fails if a cache exists. */
+int cache_set_l2(const char *path);
+
+/* Returns 1 on success and -1 on failure. Has cache_destroy save the clean
+ * entries, in their replacement order, to the snapshot file |path|, and
+ * cache_create restore them from it, mapped into memory, so a restart starts
+ * warm. NULL stops both. Fails if a cache exists. */
+int cache_set_snapshot(const char *path);
+
+/* Reads the |n| blocks at |disk_nums| and |block_nums| from the volume into
+ * the consecutive blocks of |bufs|, as one pipelined batch; returns 1 on
+ * success and -1 on failure. */
+typedef int (*cache_read_fn)(int n, const int *disk_nums, const int *block_nums, uint8_t *bufs);
+
+/* Returns 1 if the entries cache_create restored match the volume, and -1 if
+ * they do not, in which case they are all dropped. Every one of them is read
+ * back with |read| and compared. Only the first call after cache_create checks
+ * anything; call it once the volume is mounted, before other cache calls. */
+int cache_validate_snapshot(cache_read_fn read);
+
 /* Returns 1 on success and -1 on failure. Looks up the block located at
- * |disk_num| and |block_num| in cache. If |buf| is not NULL, copies the
- * contents to buf. */
+ * |disk_num| and |block_num| in cache, then in L2 if there is one. If |buf| is
+ * not NULL, copies the contents to buf. */
 int cache_lookup(int disk_num, int block_num, uint8_t *buf);
 
 /* Returns 1 on success and -1 on failure. Inserts an entry for |disk_num| and
  * |block_num| into cache. If there is already an existing entry in the cache
  * with |disk_num| and |block_num|, should update its value with data provided
- * in |buf|, which cannot be NULL. If there cache is full, should evict least
- * recently used entry and insert the new entry. */
+ * in |buf|, which cannot be NULL. If there cache is full, should evict the
+ * entry the replacement policy picks and insert the new entry. */
 int cache_insert(int disk_num, int block_num, const uint8_t *buf);
 
 void cache_update(int disk_num, int block_num, const uint8_t *buf);
 
+/* Returns 1 on success and -1 on failure. Like cache_insert, for a block that
+ * was read ahead rather than asked for. The first lookup that finds it counts
+ * as a prefetch hit; if it is evicted (or the cache destroyed) before that, it
+ * counts as a wasted prefetch. */
+int cache_insert_prefetched(int disk_num, int block_num, const uint8_t *buf);
+
+/* Returns true if the block at |disk_num| and |block_num| is cached, in
+ * either tier. Unlike
+ * cache_lookup this is not counted as a query and does not count as a use. */
+bool cache_contains(int disk_num, int block_num);
+
+/* Selects write-back mode when |fn| is not NULL, and write-through mode (the
+ * default) when it is. In write-back mode dirty entries are handed to |fn| when
+ * they are evicted or flushed. An evicted entry is handed over with the cache
+ * unlocked, so other blocks are not held up for its round trip; calls for that
+ * block wait until |fn| returns. */
+void cache_set_write_back(cache_writeback_fn fn);
+
+/* Returns true if cache is enabled and in write-back mode. */
+bool cache_write_back_enabled(void);
+
+/* Returns 1 on success and -1 on failure. Marks the cached entry for
+ * |disk_num| and |block_num| dirty; fails if it is not cached or the cache is
+ * not in write-back mode. */
+int cache_mark_dirty(int disk_num, int block_num);
+
+/* Returns 1 on success and -1 on failure. Writes every dirty entry back, in
+ * (disk, block) order, and marks it clean. */
+int cache_flush(void);
+
 /* Returns true if cache is enabled and false if not. */
 bool cache_enabled(void);
 
-/* Prints the hit rate of the cache. */
+/* What the cache has done since the program started */
+typedef struct {
+  cache_policy_t policy;    /* the replacement policy selected */
+  uint64_t queries;         /* lookups, including those made with the cache disabled */
+  uint64_t hits;            /* in either tier */
+  uint64_t misses;
+  uint64_t insertions;
+  uint64_t evictions;       /* entries replaced to make room */
+  uint64_t writebacks;      /* dirty entries written back, on eviction or flush */
+  uint64_t prefetched;      /* blocks inserted by read-ahead */
+  uint64_t prefetch_hits;
+  uint64_t prefetch_wasted;
+  uint64_t restored;        /* entries cache_create restored from the snapshot */
+  uint64_t restored_stale;  /* of those, dropped by cache_validate_snapshot */
+  uint64_t l2_hits;         /* of the hits, those found in L2 */
+  uint64_t demotions;       /* evicted entries moved to L2 */
+  uint64_t dedup_hits;      /* blocks given a body another entry held already */
+  uint64_t dedup_entries;   /* entries, and the bodies they held, when the */
+  uint64_t dedup_bodies;    /* cache was last destroyed */
+  uint64_t compressed_blocks; /* bodies in use when the cache was last */
+  uint64_t compressed_bytes;  /* destroyed, the slab bytes they took, */
+  uint64_t fill_blocks;       /* and those of one repeated byte */
+} cache_stats_t;
+
+/* Fills in |stats|. Like cache_print_hit_rate, the counts outlive cache_destroy. */
+void cache_get_stats(cache_stats_t *stats);
+
+/* Prints the hit rate of the cache and its replacement policy, that of L2 if
+ * anything was demoted to it, the dedup and compression ratios when on, and
+ * the prefetch hits and waste if anything was read ahead. */
 void cache_print_hit_rate(void);
 
 #endif
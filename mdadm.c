@@ -16,14 +16,19 @@
 
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
+#include "blockmap.h"
 #include "cache.h"
 #include "mdadm.h"
 #include "util.h"
 #include "jbod.h"
 #include "net.h"
+#include "stats.h"
 
 int check_mount = 0;
 
@@ -33,193 +38,1368 @@ uint32_t use_addr(int commandVal, int diskVal, int blockVal) {
 
 uint8_t *block = NULL;
 
+/* Readahead: a read that carries on where the previous read of the same disk
+ * stopped is part of a sequential stream, and the blocks after it are read into
+ * the cache before they are asked for. The window starts small and doubles each
+ * time the stream needs more, up to readahead_max (0 turns readahead off).
+ * Streams are tracked per channel, so that threads reading side by side do not
+ * break up each other's streams. */
+#define READAHEAD_MIN_WINDOW 4
+static int readahead_max = 0;
+
+typedef struct {
+  int last_block;    // last block the stream read, or -1
+  int next_prefetch; // first block past what has been read ahead
+  int window;        // current window, 0 while no stream is established
+} ra_stream_t;
+
+/* The scheduler: reads and writes of blocks are not sent as they are queued
+ * but held in a queue, and sent in one sweep of the head over the volume:
+ * from where the head is up to the end, then from the start (C-LOOK). Blocks
+ * that follow each other then go out as a run, each read or write moving the
+ * head on to the next without a seek, and the seeks are worked out as the
+ * sweep goes. Operations on the same block keep their order, so a read queued
+ * after a write of its block sees what was written. A synchronous queue is
+ * sent by complete(); the asynchronous one is held while the connection has
+ * more than SCHED_LOW_WATER operations in flight, so requests arriving
+ * meanwhile gather into a batch. */
+#define SCHED_LOW_WATER 0
+
+struct async_req;
+
+/* A read or write of a block waiting in a queue */
+typedef struct {
+  int key;                // the block's place on the volume, disk by disk
+  int seq;                // order it was queued in, which breaks ties
+  int dist;               // how far the head sweeps to reach it, set by dispatch
+  bool is_write;
+  uint8_t *buf;
+  struct async_req *req;  // the asynchronous request it is for, or NULL
+} sched_op_t;
+
+typedef struct {
+  sched_op_t *ops;
+  int len;
+  int cap;
+} sched_queue_t;
+
+/* A connection and what mdadm knows about the JBOD head behind it */
+typedef struct {
+  jbod_conn_t *conn; // NULL for the connection jbod_connect opened
+
+  /* Where this connection's JBOD head points, so that seeks it already
+   * satisfies can be skipped. -1 means unknown: before the first seek, after
+   * mount/unmount, and after any failed operation. It is advanced as the
+   * scheduler sends operations, since the server runs them in that order. */
+  int head_disk;
+  int head_block;
+
+  ra_stream_t streams[JBOD_NUM_DISKS];
+  uint8_t ra_bufs[MDADM_READAHEAD_MAX][JBOD_BLOCK_SIZE];
+
+  sched_queue_t queued; // synchronous reads and writes not yet sent
+} channel_t;
+
+/* The channel the calling thread issues its operations on: the main one, a
+ * worker's own pooled connection, or one opened by mdadm_thread_attach. */
+static channel_t main_chan = { NULL, -1, -1 };
+static __thread channel_t *chan = &main_chan;
+
+/* Per-disk workers: with a connection pool open, a request spanning several
+ * disks is handed to all of them and worker i serves the blocks on disks d
+ * with d % num_workers == i, each over its own connection. */
+typedef struct {
+  pthread_t thread;
+  channel_t chan;
+  uint32_t addr;     // the request being served
+  uint32_t len;
+  uint8_t *buf;
+  bool is_write;
+  uint32_t disks;    // bit d is set for the disks this worker serves
+  bool busy;         // has a request it has not finished yet
+  int rc;
+} worker_t;
+
+static worker_t workers[JBOD_MAX_POOL_CONNS];
+static int num_workers = 0;
+static int num_busy = 0;
+static bool workers_stopping = false;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t work_done = PTHREAD_COND_INITIALIZER;
+
+/* The workers serve one request at a time, whichever thread it comes from */
+static pthread_mutex_t fan_out_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* A write reads a block, merges its bytes in, and hands the result to the
+ * server and the cache in separate steps, so writers of the same block take
+ * its lock around them; blocks share BLOCK_LOCKS locks by key. */
+#define BLOCK_LOCKS 256
+static pthread_mutex_t block_locks[BLOCK_LOCKS] = { [0 ... BLOCK_LOCKS - 1] = PTHREAD_MUTEX_INITIALIZER };
+
+/* Every disk, as a mask for read_range and write_range */
+#define ALL_DISKS ((1u << JBOD_NUM_DISKS) - 1)
+
+/* How the volume is laid out over the disks: one after the other (linear), or
+ * in stripe units of stripe_blocks blocks dealt out to the disks in turn
+ * (striped). Every (disk, block) that mdadm, and so the cache, sees comes from
+ * map_block. */
+static mdadm_layout_t layout = MDADM_LINEAR;
+static int stripe_blocks = JBOD_NUM_BLOCKS_PER_DISK;
+
+/* Blocks mdadm_write reads and writes per pipelined batch. A batch of reads or
+ * of writes, plus the seeks between disks, fits in one pipeline. */
+#define WRITE_BATCH_BLOCKS (JBOD_PIPELINE_DEPTH / 2)
+
+/* The part of one block that a read or write request touches */
+typedef struct {
+  int disk_num;
+  int block_num;
+  int offset;   // first byte of the block that is touched
+  int chunk;    // number of bytes touched
+  uint32_t pos; // where those bytes are in the caller's buffer
+} block_span_t;
+
+/* An asynchronous request from mdadm_read_async or mdadm_write_async, or the
+ * write-back of a dirty block evicted while one was being served (id 0). Its
+ * operations go through the event loop of the main connection, and it moves
+ * on each time the last of them is called back. */
+typedef struct async_req {
+  int id;
+  bool is_write;
+  bool writing;         // a write whose partial blocks have been read
+  uint32_t addr;
+  uint32_t len;
+  uint8_t *buf;
+  mdadm_callback_t cb;
+  void *arg;
+  int outstanding;      // operations queued and not called back yet
+  int rc;               // 1, or -1 once anything failed
+  uint64_t started_ns;  // when it was handed in, for its latency
+  int num_partials;
+  block_span_t partials[2];
+  uint8_t partial_bufs[2][JBOD_BLOCK_SIZE];
+  struct async_req *next; // on the ready list
+} async_req_t;
+
+/* Where submit() queues operations: the synchronous pipeline when NULL,
+ * otherwise the event loop on behalf of this request. */
+static __thread async_req_t *async_target = NULL;
+
+/* Set while the asynchronous engine runs, including its callbacks */
+static __thread bool serving_async = false;
+
+/* Reads and writes of asynchronous requests not yet sent, on the main channel */
+static sched_queue_t async_queue = { NULL, 0, 0 };
+
+/* Requests that need nothing more from the server, finished by the next mdadm_poll */
+static async_req_t *ready_head = NULL;
+static async_req_t *ready_tail = NULL;
+
+static int next_request_id = 1;
+static int num_async = 0;            // requests handed out and not finished
+static long num_async_finished = 0;
+static bool async_writeback_failed = false;
+
+/* What the requests have done, for mdadm_get_stats */
+static atomic_ulong num_reads = 0;
+static atomic_ulong num_writes = 0;
+static atomic_ulong num_failed = 0;
+static atomic_ulong bytes_read = 0;
+static atomic_ulong bytes_written = 0;
+static atomic_ulong seeks_issued = 0;
+static atomic_ulong seeks_skipped = 0;
+static stats_hist_t read_latency;
+static stats_hist_t write_latency;
+
 //find minimum between two numbers; used for cache implementation in mdadm.c
 int min(int num1, int num2){
 	return (num1 > num2) ? num2 : num1;
 }
 
+/* Finds the disk and block that hold the volume address |addr|. */
+static void map_block(uint32_t addr, int *disk_num, int *block_num) {
+  int n = addr / JBOD_BLOCK_SIZE; // block of the volume
+  if (layout == MDADM_LINEAR) {
+    *disk_num = n / JBOD_NUM_BLOCKS_PER_DISK;
+    *block_num = n % JBOD_NUM_BLOCKS_PER_DISK;
+    return;
+  }
+  // Stripe unit u of the volume is unit u / JBOD_NUM_DISKS of disk u % JBOD_NUM_DISKS
+  int unit = n / stripe_blocks;
+  *disk_num = unit % JBOD_NUM_DISKS;
+  *block_num = (unit / JBOD_NUM_DISKS) * stripe_blocks + n % stripe_blocks;
+}
+
+uint32_t mdadm_block_addr(int disk_num, int block_num) {
+  if (layout == MDADM_LINEAR) {
+    return (disk_num * JBOD_NUM_BLOCKS_PER_DISK + block_num) * JBOD_BLOCK_SIZE;
+  }
+  // The inverse of map_block: the unit the block is in on its disk, then that
+  // unit's place among the units of the volume
+  int unit = (block_num / stripe_blocks) * JBOD_NUM_DISKS + disk_num;
+  return (unit * stripe_blocks + block_num % stripe_blocks) * JBOD_BLOCK_SIZE;
+}
+
+/* Returns the number of bytes of the volume that sit together on one disk,
+ * starting at a multiple of it: a whole disk, or a stripe unit. */
+static uint32_t run_size(void) {
+  return (layout == MDADM_LINEAR) ? JBOD_DISK_SIZE : stripe_blocks * JBOD_BLOCK_SIZE;
+}
+
+/* Fills in |span| for the block holding |addr_copy|, for a request that starts
+ * at |addr| and ends before |finish|. */
+static void locate(uint32_t addr, uint32_t addr_copy, uint32_t finish, block_span_t *span) {
+  map_block(addr_copy, &span->disk_num, &span->block_num);
+  span->offset = addr_copy % JBOD_BLOCK_SIZE;
+  // Up to the end of this block or the end of the request, whichever comes first
+  span->chunk = min(finish - addr_copy, JBOD_BLOCK_SIZE - span->offset);
+  span->pos = addr_copy - addr;
+}
+
+static void forget_head(void) {
+  chan->head_disk = -1;
+  chan->head_block = -1;
+}
+
+static jbod_conn_t *chan_conn(void) {
+  return chan->conn ? chan->conn : jbod_client_conn();
+}
+
+static void async_op_done(void *tag, int rc);
+
+/* Queues |op| on the calling thread's channel, or on its event loop for the
+ * asynchronous request being served. Returns 1 on success and -1 on failure. */
+static int submit(uint32_t op, uint8_t *buf) {
+  int rc = async_target ? jbod_conn_submit_async(chan_conn(), op, buf, async_op_done, async_target)
+                        : jbod_conn_submit(chan_conn(), op, buf);
+  if (rc != 0) {
+    forget_head();
+    return -1;
+  }
+  if (async_target) {
+    async_target->outstanding++;
+  }
+  return 1;
+}
+
+static int dispatch(sched_queue_t *q);
+
+/* Sends everything queued and waits for the replies. Returns 1 on success and
+ * -1 on failure. */
+static int complete(void) {
+  int rc = dispatch(&chan->queued);
+  // Whatever did go out is waited for even if the rest could not
+  if (jbod_conn_complete(chan_conn()) != 0 || rc == -1) {
+    forget_head();
+    return -1;
+  }
+  return 1;
+}
+
+/* Queues the seeks that move the head to |disk_num| and |block_num|, leaving
+ * out whichever it already satisfies. Returns 1 on success and -1 on failure. */
+static int seek_to(int disk_num, int block_num) {
+  if (chan->head_disk != disk_num) {
+    if (submit(use_addr(JBOD_SEEK_TO_DISK, disk_num, 0), block) == -1) {
+      return -1;
+    }
+    // Seeking to a disk also rewinds the head to its first block.
+    chan->head_disk = disk_num;
+    chan->head_block = 0;
+    seeks_issued++;
+  } else {
+    seeks_skipped++;
+  }
+  if (chan->head_block != block_num) {
+    if (submit(use_addr(JBOD_SEEK_TO_BLOCK, 0, block_num), block) == -1) {
+      return -1;
+    }
+    chan->head_block = block_num;
+    seeks_issued++;
+  } else {
+    seeks_skipped++;
+  }
+  return 1;
+}
+
+/* Adds a read or write of the block at |disk_num| and |block_num| to the
+ * scheduler's queue: the asynchronous one for the request being served, or
+ * else the channel's. The request is held open until the operation is sent
+ * and called back. Returns 1 on success and -1 on failure, which for the
+ * channel's queue drops what it held. */
+static int sched_add(int disk_num, int block_num, bool is_write, uint8_t *buf) {
+  sched_queue_t *q = async_target ? &async_queue : &chan->queued;
+  if (q->len == q->cap) {
+    int cap = q->cap ? q->cap * 2 : JBOD_PIPELINE_DEPTH;
+    sched_op_t *ops = realloc(q->ops, cap * sizeof(sched_op_t));
+    if (ops == NULL) {
+      // A synchronous caller gives up on the batch, whose buffers go with it
+      if (!async_target) {
+        q->len = 0;
+      }
+      return -1;
+    }
+    q->ops = ops;
+    q->cap = cap;
+  }
+  q->ops[q->len] = (sched_op_t) { .key = disk_num * JBOD_NUM_BLOCKS_PER_DISK + block_num, .seq = q->len,
+                                  .is_write = is_write, .buf = buf, .req = async_target };
+  q->len++;
+  if (async_target) {
+    async_target->outstanding++;
+  }
+  return 1;
+}
+
+/* Orders two queued operations by how far the head sweeps to reach them. */
+static int sweep_order(const void *a, const void *b) {
+  const sched_op_t *x = a, *y = b;
+  if (x->dist != y->dist) {
+    return x->dist - y->dist;
+  }
+  return x->seq - y->seq;
+}
+
+static void make_ready(struct async_req *req);
+
+/* Sends the operations of |q| in one sweep of the head, with the seeks they
+ * need, and empties it. An asynchronous request whose operation cannot be
+ * sent fails, and is finished by the next mdadm_poll if that was its last.
+ * Returns 1 on success and -1 if anything could not be sent. */
+static int dispatch(sched_queue_t *q) {
+  if (q->len == 0) {
+    return 1;
+  }
+  // The sweep starts at the head, or at the start of the volume if that is not known
+  int total = JBOD_NUM_DISKS * JBOD_NUM_BLOCKS_PER_DISK;
+  int head = chan->head_disk == -1 ? 0 : chan->head_disk * JBOD_NUM_BLOCKS_PER_DISK + chan->head_block;
+  for (int i = 0; i < q->len; i++) {
+    q->ops[i].dist = (q->ops[i].key - head + total) % total;
+  }
+  qsort(q->ops, q->len, sizeof(sched_op_t), sweep_order);
+
+  // Operations queued by callbacks while this runs go into the next sweep
+  sched_op_t *ops = q->ops;
+  int n = q->len, cap = q->cap;
+  *q = (sched_queue_t) { NULL, 0, 0 };
+
+  int rc = 1;
+  for (int i = 0; i < n; i++) {
+    sched_op_t *op = &ops[i];
+    uint32_t cmd = use_addr(op->is_write ? JBOD_WRITE_BLOCK : JBOD_READ_BLOCK, 0, 0);
+    async_target = op->req;
+    // The operation itself was counted against its request when it was queued
+    bool sent = seek_to(op->key / JBOD_NUM_BLOCKS_PER_DISK, op->key % JBOD_NUM_BLOCKS_PER_DISK) == 1 &&
+                (op->req ? jbod_conn_submit_async(chan_conn(), cmd, op->buf, async_op_done, op->req)
+                         : jbod_conn_submit(chan_conn(), cmd, op->buf)) == 0;
+    async_target = NULL;
+    if (!sent) {
+      forget_head();
+      rc = -1;
+      if (op->req) {
+        op->req->rc = -1;
+        if (--op->req->outstanding == 0) {
+          make_ready(op->req);
+        }
+      }
+      continue;
+    }
+    // Reads and writes leave the head on the next block. It does not wrap to the
+    // next disk, so past the last block it matches no later seek.
+    chan->head_block++;
+  }
+
+  // The array is kept for the next batch unless one was started meanwhile
+  if (q->ops == NULL) {
+    *q = (sched_queue_t) { ops, 0, cap };
+  } else {
+    free(ops);
+  }
+  return rc;
+}
+
+/* Queues a read of the block at |disk_num| and |block_num| into |buf|, which
+ * is filled in by the next complete(). Returns 1 on success and -1 on failure. */
+static int queue_read(int disk_num, int block_num, uint8_t *buf) {
+  return sched_add(disk_num, block_num, false, buf);
+}
+
+/* Reads the |n| blocks at |disk_nums| and |block_nums| into the consecutive
+ * blocks of |bufs| as one batch and waits for them. Returns 1 on success and
+ * -1 on failure; the cache and the block map check what they restored against
+ * the volume with it. */
+static int read_blocks(int n, const int *disk_nums, const int *block_nums, uint8_t *bufs) {
+  for (int i = 0; i < n; i++) {
+    if (queue_read(disk_nums[i], block_nums[i], bufs + (size_t) i * JBOD_BLOCK_SIZE) == -1) {
+      return -1;
+    }
+  }
+  return complete();
+}
+
+/* Queues a write of |buf| to the block at |disk_num| and |block_num|. Returns 1
+ * on success and -1 on failure. */
+static int queue_write(int disk_num, int block_num, const uint8_t *buf) {
+  // The block is only sent for a write, never filled in, so dropping const is safe.
+  return sched_add(disk_num, block_num, true, (uint8_t *)buf);
+}
+
+/* Writes |buf| to the block at |disk_num| and |block_num| and waits for it.
+ * Returns 1 on success and -1 on failure; in write-back mode this is the
+ * handler the cache calls for dirty blocks. */
+static int queue_async_writeback(int disk_num, int block_num, const uint8_t *buf);
+
+static int write_block(int disk_num, int block_num, const uint8_t *buf) {
+  // Waiting here would stall the event loop, so the write joins it instead.
+  if (serving_async) {
+    return queue_async_writeback(disk_num, block_num, buf);
+  }
+  if (queue_write(disk_num, block_num, buf) == -1) {
+    return -1;
+  }
+  return complete();
+}
+
+/* Returns the lock writers of the block at |disk_num| and |block_num| take. */
+static pthread_mutex_t *block_lock(int disk_num, int block_num) {
+  return &block_locks[(disk_num * JBOD_NUM_BLOCKS_PER_DISK + block_num) % BLOCK_LOCKS];
+}
+
+/* Caches |data| as the new contents of the block at |disk_num| and |block_num|,
+ * marked dirty, and records it in the block map. Returns true if it was, and
+ * false if the block still has to be written to the server. The caller holds
+ * the block's lock. */
+static bool cache_dirty(int disk_num, int block_num, const uint8_t *data) {
+  if (cache_insert(disk_num, block_num, data) == -1) {
+    cache_update(disk_num, block_num, data);
+  }
+  if (cache_mark_dirty(disk_num, block_num) != 1) {
+    return false;
+  }
+  blockmap_record(disk_num, block_num, data);
+  return true;
+}
+
+static void forget_streams(channel_t *c) {
+  for (int d = 0; d < JBOD_NUM_DISKS; d++) {
+    c->streams[d].last_block = -1;
+    c->streams[d].next_prefetch = 0;
+    c->streams[d].window = 0;
+  }
+}
+
+/* Feeds a read of blocks |first| to |last| of |disk_num| to that disk's stream
+ * detector. If the read continues a sequential stream whose read-ahead blocks
+ * are running out, queues reads of the next window into |bufs|, which has room
+ * for |room| blocks: they start where the head is left by the read, so no seek
+ * is needed. Returns how many blocks were queued, starting at *|start|, or -1
+ * on failure. */
+static int queue_readahead(int disk_num, int first, int last, int *start,
+                           uint8_t (*bufs)[JBOD_BLOCK_SIZE], int room) {
+  ra_stream_t *s = &chan->streams[disk_num];
+  bool sequential = (s->last_block != -1 && (first == s->last_block || first == s->last_block + 1));
+  s->last_block = last;
+  if (!sequential) {
+    s->window = 0;
+    s->next_prefetch = last + 1;
+    return 0;
+  }
+
+  // Refill once the reader has eaten into the second half of the window.
+  if (s->window > 0 && s->next_prefetch > last + s->window / 2) {
+    return 0;
+  }
+  s->window = min(s->window == 0 ? READAHEAD_MIN_WINDOW : s->window * 2, readahead_max);
+
+  int from = (s->next_prefetch > last) ? s->next_prefetch : last + 1;
+  int to = min(last + 1 + s->window, JBOD_NUM_BLOCKS_PER_DISK);
+  int n = 0;
+  for (int b = from; b < to; b++) {
+    // Out of buffers: the rest of the window is left for the next read.
+    if (n == room) {
+      to = b;
+      break;
+    }
+    // Anything already cached may be newer than the disk, and anything the
+    // block map knows needs no read; the run stops there.
+    if (cache_contains(disk_num, b) || blockmap_known(disk_num, b)) {
+      break;
+    }
+    if (queue_read(disk_num, b, bufs[n]) == -1) {
+      return -1;
+    }
+    n++;
+  }
+  s->next_prefetch = to;
+  *start = from;
+  return n;
+}
+
+int mdadm_set_layout(mdadm_layout_t new_layout, int stripe_unit) {
+  if (check_mount != 0) {
+    return -1;
+  }
+  if (new_layout == MDADM_LINEAR) {
+    layout = MDADM_LINEAR;
+    stripe_blocks = JBOD_NUM_BLOCKS_PER_DISK;
+    return 1;
+  }
+  // The units have to tile each disk exactly, so a unit is a power of two number of blocks.
+  int blocks = stripe_unit / JBOD_BLOCK_SIZE;
+  if (new_layout != MDADM_STRIPED || stripe_unit % JBOD_BLOCK_SIZE != 0 ||
+      blocks < 1 || blocks > JBOD_NUM_BLOCKS_PER_DISK || (blocks & (blocks - 1)) != 0) {
+    return -1;
+  }
+  layout = MDADM_STRIPED;
+  stripe_blocks = blocks;
+  return 1;
+}
+
+int mdadm_set_readahead(int max_blocks) {
+  if (max_blocks < 0 || max_blocks > MDADM_READAHEAD_MAX) {
+    return -1;
+  }
+  readahead_max = max_blocks;
+  forget_streams(chan);
+  return 1;
+}
+
+void mdadm_set_write_back(bool enabled) {
+  cache_set_write_back(enabled ? write_block : NULL);
+}
+
+int mdadm_thread_attach(void) {
+  if (chan != &main_chan) {
+    return -1; // already attached, or a worker
+  }
+  channel_t *c = malloc(sizeof(channel_t));
+  if (c == NULL) {
+    return -1;
+  }
+  c->conn = jbod_conn_open();
+  if (c->conn == NULL) {
+    free(c);
+    return -1;
+  }
+  c->head_disk = -1;
+  c->head_block = -1;
+  c->queued = (sched_queue_t) { NULL, 0, 0 };
+  forget_streams(c);
+  chan = c;
+  return 1;
+}
+
+void mdadm_thread_detach(void) {
+  if (chan == &main_chan) {
+    return;
+  }
+  jbod_conn_close(chan->conn);
+  free(chan->queued.ops);
+  free(chan);
+  chan = &main_chan;
+}
+
+static int read_range(uint32_t addr, uint32_t len, uint8_t *buf, uint32_t disks);
+static int write_range(uint32_t addr, uint32_t len, const uint8_t *buf, uint32_t disks);
+
+/* Runs worker |arg|: waits for segments, serves them over its own channel and
+ * reports back, until the workers are stopped. */
+static void *worker_main(void *arg) {
+  worker_t *w = arg;
+  chan = &w->chan;
+
+  pthread_mutex_lock(&pool_lock);
+  while (true) {
+    while (!w->busy && !workers_stopping) {
+      pthread_cond_wait(&work_ready, &pool_lock);
+    }
+    if (!w->busy) {
+      break;
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    // Only the blocks on this worker's disks; the other workers see to the rest.
+    int rc = w->is_write ? write_range(w->addr, w->len, w->buf, w->disks) : read_range(w->addr, w->len, w->buf, w->disks);
+
+    pthread_mutex_lock(&pool_lock);
+    w->rc = rc;
+    w->busy = false;
+    if (--num_busy == 0) {
+      pthread_cond_signal(&work_done);
+    }
+  }
+  pthread_mutex_unlock(&pool_lock);
+  return NULL;
+}
+
+/* Starts a worker for each pooled connection. Returns 1 on success and -1 on failure. */
+static int start_workers(void) {
+  int n = jbod_pool_size();
+  workers_stopping = false;
+  for (num_workers = 0; num_workers < n; num_workers++) {
+    worker_t *w = &workers[num_workers];
+    w->chan.conn = jbod_pool_conn(num_workers);
+    w->disks = 0;
+    for (int d = num_workers; d < JBOD_NUM_DISKS; d += n) {
+      w->disks |= 1u << d;
+    }
+    w->busy = false;
+    if (pthread_create(&w->thread, NULL, worker_main, w) != 0) {
+      return -1;
+    }
+  }
+  return 1;
+}
+
+/* Stops the workers and waits for them to exit. */
+static void stop_workers(void) {
+  pthread_mutex_lock(&pool_lock);
+  workers_stopping = true;
+  pthread_cond_broadcast(&work_ready);
+  pthread_mutex_unlock(&pool_lock);
+  for (int i = 0; i < num_workers; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+  num_workers = 0;
+}
+
+/* Returns the disks that hold some of the range, as a mask. */
+static uint32_t disks_touched(uint32_t addr, uint32_t len) {
+  uint32_t disks = 0;
+  uint32_t run = run_size();
+  // Every run of the range lies on a single disk
+  for (uint32_t a = addr - addr % run; a < addr + len && disks != ALL_DISKS; a += run) {
+    int disk_num, block_num;
+    map_block(a, &disk_num, &block_num);
+    disks |= 1u << disk_num;
+  }
+  return disks;
+}
+
+/* Hands the range to every worker serving one of the disks it touches, each to
+ * do its own disks' part, and waits until all of them are done. Returns |len|
+ * on success and -1 if any part failed. */
+static int fan_out(uint32_t addr, uint32_t len, uint8_t *buf, bool is_write, uint32_t disks) {
+  pthread_mutex_lock(&fan_out_lock);
+  pthread_mutex_lock(&pool_lock);
+  for (int i = 0; i < num_workers; i++) {
+    worker_t *w = &workers[i];
+    w->rc = 1;
+    if (w->disks & disks) {
+      w->addr = addr;
+      w->len = len;
+      w->buf = buf;
+      w->is_write = is_write;
+      w->busy = true;
+      num_busy++;
+    }
+  }
+  pthread_cond_broadcast(&work_ready);
+  while (num_busy > 0) {
+    pthread_cond_wait(&work_done, &pool_lock);
+  }
+  pthread_mutex_unlock(&pool_lock);
+
+  int rc = len;
+  for (int i = 0; i < num_workers; i++) {
+    if (workers[i].rc == -1) {
+      rc = -1;
+    }
+  }
+  pthread_mutex_unlock(&fan_out_lock);
+  return rc;
+}
+
+/* Returns true if the range should be fanned out: workers are running and it
+ * crosses from one disk onto another. */
+static bool spans_disks(uint32_t addr, uint32_t len) {
+  return num_workers > 0 && len > 0 && addr / run_size() != (addr + len - 1) / run_size();
+}
+
+static int sync_barrier(void);
+
 int mdadm_mount(void) {
   uint32_t op = use_addr(JBOD_MOUNT, 0, 0);
+  if (sync_barrier() == -1) {
+    return -1;
+  }
+  forget_head();
+  forget_streams(chan);
    if (jbod_client_operation(op, NULL) == 0){
+     // Workers come up with the volume, one per pooled connection. Without
+     // them the mount is undone, so that a later mdadm_mount can try again.
+     if (num_workers == 0 && start_workers() == -1) {
+       stop_workers();
+       jbod_client_operation(use_addr(JBOD_UNMOUNT, 0, 0), NULL);
+       forget_head();
+       return -1;
+     }
+     for (int i = 0; i < num_workers; i++) {
+       workers[i].chan.head_disk = -1;
+       workers[i].chan.head_block = -1;
+       forget_streams(&workers[i].chan);
+     }
      check_mount = 1;
+     // A cache warmed up from a snapshot has to hold what was just mounted;
+     // if it does not, it starts cold instead.
+     cache_validate_snapshot(read_blocks);
+     // The block map is checked against the volume the same way
+     blockmap_mount(read_blocks);
      return 1;
    }
    return -1;
 }
 
 int mdadm_unmount(void) {
+  // Asynchronous requests, then the dirty blocks held back by write-back mode,
+  // have to reach the disks first.
+  if (sync_barrier() == -1 || cache_flush() == -1){
+    return -1;
+  }
+  stop_workers();
   uint32_t op = use_addr(JBOD_UNMOUNT, 0, 0);
+  forget_head();
    if (jbod_client_operation(op, NULL) == 0){
      check_mount = 0;
-     return 1;
+     return blockmap_unmount();
    }
    return -1;
 }
 
 
 
-int mdadm_read(uint32_t addr, uint32_t len, uint8_t *buf) {
-  /* YOUR CODE */
-  if((check_mount == 0)||(len + addr > 1048576)|| (len > 1024) || (len > 0 && buf == NULL)){
-    return -1;
-    }
-  int finish = len + addr; // Calculate final address
+/* Returns true if a request for |len| bytes at |addr| can be served: the
+ * volume is mounted, the range lies within it, and there is a buffer. */
+static bool valid_request(uint32_t addr, uint32_t len, const uint8_t *buf) {
+  return check_mount != 0 && addr <= MDADM_VOLUME_SIZE && len <= MDADM_VOLUME_SIZE - addr &&
+         (len == 0 || buf != NULL);
+}
 
-  //cache implementation 
+/* Reads the blocks of a range of the volume that lie on the |disks| given as a
+ * mask into |buf|. Whole blocks are read straight into |buf|. The misses go
+ * out a disk at a time, each disk's blocks as a run behind a single seek,
+ * JBOD_PIPELINE_DEPTH requests at a time. */
+static int read_range(uint32_t addr, uint32_t len, uint8_t *buf, uint32_t disks) {
+  uint32_t finish = len + addr; // Calculate final address
 
-  int final_read = 0;
+  // Whole blocks are read straight into the caller's buffer. Only the first and
+  // last block can be partial; they go through these and are copied out at the end.
+  uint8_t partial_bufs[2][JBOD_BLOCK_SIZE];
+  block_span_t partials[2];
+  int num_partials = 0;
 
- // Loop through each block needed for the read operation
-  for(int addr_copy = addr; addr_copy < finish;){
+  // Where the read-ahead blocks of each disk went, if it had any
+  int ra_start[JBOD_NUM_DISKS], ra_count[JBOD_NUM_DISKS], ra_first[JBOD_NUM_DISKS];
+  int ra_used = 0;
 
-    // Calculate the disk and block numbers based on the current address
-    int dB = addr_copy / 65536;
-    int new_num = (addr_copy % 65536) / 256;
-    int new_value = addr_copy % 256; //offset
-    int remain = addr_copy % 256;
-    int rem_bytes = 256 - remain;
+  // Queue a read for every block that is not cached, then collect them all at once
+  disks &= disks_touched(addr, len);
+  for (int d = 0; d < JBOD_NUM_DISKS; d++) {
+    ra_count[d] = 0;
+    if (!(disks & (1u << d))) {
+      continue;
+    }
 
-    // Calculate the destination address in the buffer and the amount to copy
-    uint8_t *address_value = buf + (addr_copy - addr);
-    uint8_t remainder = finish - addr_copy;
-    
-    uint8_t temporaryBuf[256];
-
-    //int index_for_cache = -1;
-    // If cache is active, attempt to locate the specified block within it.
-    if (cache_enabled() == true) {
-      if (cache_lookup(dB, new_num, temporaryBuf) == -1){
-        // Seek to the correct disk
-        uint32_t op1 = use_addr(JBOD_SEEK_TO_DISK, dB, 0);
-        jbod_client_operation(op1, block);
-        
-        // Seek to the correct block within the disk
-        uint32_t op2 = use_addr(JBOD_SEEK_TO_BLOCK,0, new_num);
-        jbod_client_operation(op2, block);
-        
-        // Read the current block into the temporary buffer
-        uint32_t op3 = use_addr(JBOD_READ_BLOCK, 0, 0);
-        jbod_client_operation(op3, temporaryBuf);
+    int first_block = -1, last_block = -1;
+    uint32_t addr_copy = addr;
+    while (addr_copy < finish) {
+      block_span_t span;
+      locate(addr, addr_copy, finish, &span);
+      addr_copy += span.chunk;
+      if (span.disk_num != d) {
+        continue;
+      }
+      if (first_block == -1) {
+        first_block = span.block_num;
+      }
+      last_block = span.block_num;
+
+      bool whole = (span.chunk == JBOD_BLOCK_SIZE);
+      uint8_t *dest = whole ? buf + span.pos : partial_bufs[num_partials];
+
+      // A block the block map knows, or the cache holds, needs no trip to the server.
+      if (blockmap_lookup(span.disk_num, span.block_num, dest) ||
+          (cache_enabled() == true && cache_lookup(span.disk_num, span.block_num, dest) == 1)) {
+        if (!whole) {
+          memcpy(buf + span.pos, dest + span.offset, span.chunk);
         }
-      else {
-        final_read += min(remainder, rem_bytes);
-        addr_copy += min(remainder, rem_bytes);
+        continue;
+      }
+      if (queue_read(span.disk_num, span.block_num, dest) == -1) {
+        return -1;
+      }
+      if (!whole) {
+        partials[num_partials++] = span;
       }
     }
 
-    else{
-      // Seek to the correct disk
-      uint32_t op1 = use_addr(JBOD_SEEK_TO_DISK, dB, 0);
-      jbod_client_operation(op1, block);
-      
-      // Seek to the correct block within the disk
-      uint32_t op2 = use_addr(JBOD_SEEK_TO_BLOCK,0, new_num);
-      jbod_client_operation(op2, block);
-      
-      // Read the current block into the temporary buffer
-      uint32_t op3 = use_addr(JBOD_READ_BLOCK, 0, 0);
-      jbod_client_operation(op3, temporaryBuf);
+    // Read ahead of this disk's part of the request in the same batch, while
+    // the head is still on the disk.
+    if (readahead_max > 0 && cache_enabled() == true) {
+      ra_first[d] = ra_used;
+      ra_count[d] = queue_readahead(d, first_block, last_block, &ra_start[d],
+                                    chan->ra_bufs + ra_used, MDADM_READAHEAD_MAX - ra_used);
+      if (ra_count[d] == -1) {
+        return -1;
+      }
+      ra_used += ra_count[d];
     }
- 
-    // Determine how many bytes to copy: either the remainder or up to 256 bytes
-    int  holder_value = (finish - addr_copy < 256) ? remainder : 256;
-    memcpy(address_value, temporaryBuf, holder_value);
+  }
+
+  if (complete() == -1) {
+    return -1;
+  }
 
-     // Move to the next block, adjusting for any initial offset within the block
-    addr_copy = (addr_copy - new_value) + 256;
+  for (int d = 0; d < JBOD_NUM_DISKS; d++) {
+    for (int i = 0; i < ra_count[d]; i++) {
+      cache_insert_prefetched(d, ra_start[d] + i, chan->ra_bufs[ra_first[d] + i]);
     }
+  }
 
-  return len; // Return the total number of bytes intended to read
+  for (int i = 0; i < num_partials; i++) {
+    memcpy(buf + partials[i].pos, partial_bufs[i] + partials[i].offset, partials[i].chunk);
+  }
 
+  return len; // Return the total number of bytes read
+}
+
+
+/* Takes the locks of the |n| blocks of |spans|, in the order they lie in
+ * block_locks and a shared one once, so that writers whose batches share
+ * blocks cannot deadlock. Fills |held| with them and returns how many. */
+static int lock_blocks(const block_span_t *spans, int n, pthread_mutex_t **held) {
+  int num_held = 0;
+  for (int i = 0; i < n; i++) {
+    pthread_mutex_t *lock = block_lock(spans[i].disk_num, spans[i].block_num);
+    int j = num_held;
+    for (; j > 0 && held[j - 1] > lock; j--) {
+    }
+    if (j > 0 && held[j - 1] == lock) {
+      continue;
+    }
+    memmove(&held[j + 1], &held[j], (num_held - j) * sizeof(*held));
+    held[j] = lock;
+    num_held++;
   }
+  for (int i = 0; i < num_held; i++) {
+    pthread_mutex_lock(held[i]);
+  }
+  return num_held;
+}
 
+/* Writes the |n| blocks of |spans| from |buf|, which write_range has locked.
+ * Blocks the write covers completely are sent straight from |buf|; only a
+ * partial first or last block needs its old contents read (read-modify-write).
+ * Returns 1 on success and -1 on failure. */
+static int write_batch(const uint8_t *buf, const block_span_t *spans, int n) {
+  uint8_t blocks[WRITE_BATCH_BLOCKS][JBOD_BLOCK_SIZE];
+  const uint8_t *data[WRITE_BATCH_BLOCKS]; // the new contents of each block
+  bool deferred[WRITE_BATCH_BLOCKS];
 
-int mdadm_write(uint32_t addr, uint32_t len, const uint8_t *buf) {
-  if((check_mount == 0)||(len + addr > 1048576)|| (len > 1024) || (len > 0 && buf == NULL)){ //this  checks if the mount status and inputs are valid
-    return -1; //returns -1 if not mounted, not in the correct bytes range, or the buf is NULL
+  // Read the current contents of each partial block, from the cache if possible,
+  // so the bytes outside the write are preserved. Misses go out as one batch.
+  for (int i = 0; i < n; i++) {
+    if (spans[i].chunk == JBOD_BLOCK_SIZE) {
+      data[i] = buf + spans[i].pos;
+      continue;
+    }
+    data[i] = blocks[i];
+    if (!blockmap_lookup(spans[i].disk_num, spans[i].block_num, blocks[i]) &&
+        !(cache_enabled() == true && cache_lookup(spans[i].disk_num, spans[i].block_num, blocks[i]) == 1)) {
+      if (queue_read(spans[i].disk_num, spans[i].block_num, blocks[i]) == -1) {
+        return -1;
+      }
+    }
+  }
+  if (complete() == -1) {
+    return -1;
+  }
+
+  for (int i = 0; i < n; i++) {
+    // Copy the data from the caller's buffer into a partial block
+    if (data[i] == blocks[i]) {
+      memcpy(blocks[i] + spans[i].offset, buf + spans[i].pos, spans[i].chunk);
     }
 
-  // Initialize a variable to keep track of the current position in the buffer
-  int new_var = 0;
+    // In write-back mode the modified block only goes into the cache, marked
+    // dirty; the server sees it when it is evicted, flushed or unmounted.
+    deferred[i] = false;
+    if (cache_write_back_enabled() == true) {
+      deferred[i] = cache_dirty(spans[i].disk_num, spans[i].block_num, data[i]);
+    }
+  }
 
-  int finish = len + addr; //storing end address
+  // Write the modified blocks back as one batch; the scheduler sends each
+  // disk's blocks as a run behind a single seek. Until the batch is in,
+  // what the blocks hold is not known for sure.
+  for (int i = 0; i < n; i++) {
+    if (deferred[i]) {
+      continue;
+    }
+    blockmap_record(spans[i].disk_num, spans[i].block_num, NULL);
+    if (queue_write(spans[i].disk_num, spans[i].block_num, data[i]) == -1) {
+      return -1;
+    }
+  }
+  if (complete() == -1) {
+    return -1;
+  }
+  for (int i = 0; i < n; i++) {
+    if (!deferred[i]) {
+      blockmap_record(spans[i].disk_num, spans[i].block_num, data[i]);
+    }
+  }
 
-  // Loop through each block of 256 bytes
-  int addr_copy = addr; // Initialize addr_copy with addr, moved outside the loop
-  //int final_read = 0;
+  ///Check if caching is enabled before proceeding with cache operations.
+  for (int i = 0; i < n; i++) {
+    if (!deferred[i] && cache_enabled() == true) {
+      // Attempt to insert a new block into the cache; update the block if it already exists.
+      if (cache_insert(spans[i].disk_num, spans[i].block_num, data[i]) == -1){
+        cache_update(spans[i].disk_num, spans[i].block_num, data[i]); // Update existing entry with new data.
+      }
+    }
+  }
+  return 1;
+}
+
+/* Writes |buf| to the blocks of a range of the volume that lie on the |disks|
+ * given as a mask, a batch of WRITE_BATCH_BLOCKS blocks at a time. */
+static int write_range(uint32_t addr, uint32_t len, const uint8_t *buf, uint32_t disks) {
+  uint32_t finish = len + addr; //storing end address
+
+  // Work through the request a batch of blocks at a time
+  uint32_t addr_copy = addr;
   while(addr_copy < finish){
-      int dB = addr_copy / 65536; // Calculate the disk number for the current block
-      int num_for_block = (addr_copy % 65536) / 256; // Calculate the block number for the current block
-      int new_value = addr_copy % 256; // Calculate the offset within the block
-      //int remain = addr_copy % 256;
-      //int rem_bytes = 256 - remain;
-
-      //uint8_t *address_value = buf + (addr_copy - addr);
-      //uint8_t remainder = finish - addr_copy;
-      
-      // Create a temporary buffer of size 256 bytes
-      uint8_t temporaryBuf[256];
-
-      if (cache_enabled() == true) {
-        if (cache_lookup(dB, num_for_block, temporaryBuf) == -1){
-          // Seek to the correct disk
-          uint32_t op1 = use_addr(JBOD_SEEK_TO_DISK, dB, 0);
-          jbod_client_operation(op1, block);
-          
-          // Seek to the correct block within the disk
-          uint32_t op2 = use_addr(JBOD_SEEK_TO_BLOCK,0, num_for_block);
-          jbod_client_operation(op2, block);
-          
-          // Read the current block into the temporary buffer
-          uint32_t op3 = use_addr(JBOD_READ_BLOCK, 0, 0);
-          jbod_client_operation(op3, temporaryBuf);
-          }
-      }
-      else {
-        // Seek to the correct disk
-        uint32_t op1 = use_addr(JBOD_SEEK_TO_DISK, dB, 0);
-        jbod_client_operation(op1, block);
-        
-        // Seek to the correct block within the disk
-        uint32_t op2 = use_addr(JBOD_SEEK_TO_BLOCK,0, num_for_block);
-        jbod_client_operation(op2, block);
-        
-        // Read the current block into the temporary buffer
-        uint32_t op3 = use_addr(JBOD_READ_BLOCK, 0, 0);
-        jbod_client_operation(op3, temporaryBuf);
-    }
-
-      int remaining_distance_to_process = finish - addr_copy; // Calculate remaining distance to process
-
-      // Determine the amount of data to process, ensuring it's a positive step forward
-      int temp_distance_hold = (remaining_distance_to_process < (256 - new_value)) ? remaining_distance_to_process : (256 - new_value);
-      // temp_distance_hold = temp_distance_hold > 0 ? temp_distance_hold : 1; // Ensure at least 1 byte is processed to avoid infinite loop
-
-      // Read the data from the temporary buffer into the actual buffer
-      memcpy(temporaryBuf + new_value, buf + new_var, temp_distance_hold);
-
-
-      // Write the modified block back
-      uint32_t op4 = use_addr(JBOD_SEEK_TO_DISK, dB, 0); 
-      jbod_client_operation(op4, block);
-      uint32_t op5 = use_addr(JBOD_SEEK_TO_BLOCK, 0, num_for_block);
-      jbod_client_operation(op5, block);
-      uint32_t op6 = use_addr(JBOD_WRITE_BLOCK, 0, 0);
-      jbod_client_operation(op6, temporaryBuf);
-
-
-      ///Check if caching is enabled before proceeding with cache operations.
-      if (cache_enabled() == true) {
-        // Attempt to insert a new block into the cache; update the block if it already exists.
-        if (cache_insert(dB, num_for_block, temporaryBuf) == -1){
-          cache_update(dB, num_for_block, temporaryBuf); // Update existing entry with new data.
+      block_span_t spans[WRITE_BATCH_BLOCKS];
+      int n = 0;
+      while (n < WRITE_BATCH_BLOCKS && addr_copy < finish) {
+        locate(addr, addr_copy, finish, &spans[n]);
+        addr_copy += spans[n].chunk;
+        if (disks & (1u << spans[n].disk_num)) {
+          n++; // otherwise another worker's block
         }
       }
 
-      // Update addr_copy and new_var to progress through the data
-      addr_copy += temp_distance_hold;
-      new_var += temp_distance_hold;
+      // Every block of the batch stays locked, in any cache mode, from the read
+      // of its old contents until the cache and, unless write-back mode holds
+      // them back, the server have its new ones.
+      // Otherwise another write to a partial block could land in between and be
+      // lost, and two writes to a block could reach the server in one order and
+      // the cache in the other.
+      pthread_mutex_t *held[WRITE_BATCH_BLOCKS];
+      int num_held = lock_blocks(spans, n, held);
+      int rc = write_batch(buf, spans, n);
+      for (int i = num_held - 1; i >= 0; i--) {
+        pthread_mutex_unlock(held[i]);
+      }
+      if (rc == -1) {
+        return -1;
+      }
   }
 
   return len; // Return the length of the data written
 }
+
+/* Queues the reads of an asynchronous read, or the reads of the partial blocks
+ * of an asynchronous write, a disk at a time as in read_range. Cached blocks
+ * are copied right away. Returns 1 on success and -1 on failure. */
+static int queue_async_reads(async_req_t *req) {
+  uint32_t finish = req->addr + req->len;
+  uint32_t disks = disks_touched(req->addr, req->len);
+  for (int d = 0; d < JBOD_NUM_DISKS; d++) {
+    if (!(disks & (1u << d))) {
+      continue;
+    }
+    for (uint32_t addr_copy = req->addr; addr_copy < finish; ) {
+      block_span_t span;
+      locate(req->addr, addr_copy, finish, &span);
+      addr_copy += span.chunk;
+      bool whole = (span.chunk == JBOD_BLOCK_SIZE);
+      if (span.disk_num != d || (whole && req->is_write)) {
+        continue;
+      }
+
+      uint8_t *dest = whole ? req->buf + span.pos : req->partial_bufs[req->num_partials];
+      if (!whole) {
+        req->partials[req->num_partials++] = span;
+      }
+      if (blockmap_lookup(span.disk_num, span.block_num, dest) ||
+          (cache_enabled() == true && cache_lookup(span.disk_num, span.block_num, dest) == 1)) {
+        continue;
+      }
+      if (queue_read(span.disk_num, span.block_num, dest) == -1) {
+        return -1;
+      }
+    }
+  }
+  return 1;
+}
+
+/* Returns the buffer holding the partial block of |req| whose bytes are at
+ * |pos| in the caller's buffer. */
+static uint8_t *partial_block(async_req_t *req, uint32_t pos) {
+  int i = 0;
+  while (i < req->num_partials - 1 && req->partials[i].pos != pos) {
+    i++;
+  }
+  return req->partial_bufs[i];
+}
+
+/* Merges the caller's data into the partial blocks of an asynchronous write and
+ * queues the writes, a disk at a time. In write-back mode the blocks go into
+ * the cache instead, as in write_range. Returns 1 on success and -1 on failure. */
+static int queue_async_writes(async_req_t *req) {
+  for (int i = 0; i < req->num_partials; i++) {
+    memcpy(req->partial_bufs[i] + req->partials[i].offset, req->buf + req->partials[i].pos, req->partials[i].chunk);
+  }
+
+  uint32_t finish = req->addr + req->len;
+  uint32_t disks = disks_touched(req->addr, req->len);
+  for (int d = 0; d < JBOD_NUM_DISKS; d++) {
+    if (!(disks & (1u << d))) {
+      continue;
+    }
+    for (uint32_t addr_copy = req->addr; addr_copy < finish; ) {
+      block_span_t span;
+      locate(req->addr, addr_copy, finish, &span);
+      addr_copy += span.chunk;
+      if (span.disk_num != d) {
+        continue;
+      }
+
+      bool whole = (span.chunk == JBOD_BLOCK_SIZE);
+      uint8_t *data = whole ? req->buf + span.pos : partial_block(req, span.pos);
+      if (cache_write_back_enabled() == true) {
+        // A thread's write may have cached the block since it was read, so a
+        // partial block is merged into the cached copy, under the block's lock.
+        pthread_mutex_t *lock = block_lock(span.disk_num, span.block_num);
+        pthread_mutex_lock(lock);
+        if (!whole && cache_lookup(span.disk_num, span.block_num, data) == 1) {
+          memcpy(data + span.offset, req->buf + span.pos, span.chunk);
+        }
+        bool cached = cache_dirty(span.disk_num, span.block_num, data);
+        pthread_mutex_unlock(lock);
+        if (cached) {
+          continue;
+        }
+      }
+      // finish_async records the block in the block map once the write is in
+      blockmap_record(span.disk_num, span.block_num, NULL);
+      if (queue_write(span.disk_num, span.block_num, data) == -1) {
+        return -1;
+      }
+    }
+  }
+  return 1;
+}
+
+/* Counts a read or write of |len| bytes that started at |started_ns| and
+ * ended with |rc|: 1 for success, -1 for failure. */
+static void count_request(bool is_write, uint32_t len, int rc, uint64_t started_ns) {
+  if (rc == -1) {
+    num_failed++;
+  } else if (is_write) {
+    num_writes++;
+    bytes_written += len;
+    stats_hist_record(&write_latency, started_ns);
+  } else {
+    num_reads++;
+    bytes_read += len;
+    stats_hist_record(&read_latency, started_ns);
+  }
+}
+
+/* Hands |req| to the caller's callback, or the next mdadm_poll, and frees it. */
+static void finish_async(async_req_t *req) {
+  uint32_t finish = req->addr + req->len;
+
+  if (req->rc == 1 && !req->is_write) {
+    for (int i = 0; i < req->num_partials; i++) {
+      memcpy(req->buf + req->partials[i].pos, req->partial_bufs[i] + req->partials[i].offset, req->partials[i].chunk);
+    }
+  }
+  // The server has the blocks now, so the block map and the cache can have them
+  // too. In write-back mode queue_async_writes already gave them what it cached,
+  // and another write may have come after that.
+  if (req->rc == 1 && req->is_write && req->id != 0 && cache_write_back_enabled() == false) {
+    for (uint32_t addr_copy = req->addr; addr_copy < finish; ) {
+      block_span_t span;
+      locate(req->addr, addr_copy, finish, &span);
+      addr_copy += span.chunk;
+      const uint8_t *data = (span.chunk == JBOD_BLOCK_SIZE) ? req->buf + span.pos : partial_block(req, span.pos);
+      blockmap_record(span.disk_num, span.block_num, data);
+      if (cache_enabled() == true && cache_insert(span.disk_num, span.block_num, data) == -1) {
+        cache_update(span.disk_num, span.block_num, data);
+      }
+    }
+  }
+
+  if (req->id == 0) {
+    if (req->rc == -1) {
+      async_writeback_failed = true;
+    }
+  } else {
+    num_async--;
+    num_async_finished++;
+    count_request(req->is_write, req->len, req->rc, req->started_ns);
+    if (req->cb) {
+      req->cb(req->id, req->rc == 1 ? (int) req->len : -1, req->arg);
+    }
+  }
+  free(req);
+}
+
+/* Moves |req| on once the last of its operations has been called back: a
+ * write goes from reading its partial blocks to writing, and anything else
+ * is finished. */
+static void advance_async(async_req_t *req) {
+  if (req->is_write && !req->writing && req->rc == 1) {
+    req->writing = true;
+    async_target = req;
+    if (queue_async_writes(req) == -1) {
+      req->rc = -1;
+    }
+    async_target = NULL;
+  }
+  if (req->outstanding == 0) {
+    finish_async(req);
+  }
+}
+
+/* Called back by the event loop for each operation of an asynchronous request. */
+static void async_op_done(void *tag, int rc) {
+  async_req_t *req = tag;
+  if (rc != 0) {
+    req->rc = -1;
+    forget_head();
+  }
+  if (--req->outstanding == 0) {
+    bool was_serving = serving_async;
+    serving_async = true;
+    advance_async(req);
+    serving_async = was_serving;
+  }
+}
+
+/* Queues a write of a copy of |buf| as a request of its own. Returns 1 on
+ * success and -1 on failure. */
+static int queue_async_writeback(int disk_num, int block_num, const uint8_t *buf) {
+  async_req_t *wb = calloc(1, sizeof(async_req_t));
+  if (wb == NULL) {
+    return -1;
+  }
+  wb->is_write = true;
+  wb->writing = true;
+  wb->rc = 1;
+  memcpy(wb->partial_bufs[0], buf, JBOD_BLOCK_SIZE);
+
+  async_req_t *saved = async_target;
+  async_target = wb;
+  int rc = queue_write(disk_num, block_num, wb->partial_bufs[0]);
+  async_target = saved;
+  if (rc == -1) {
+    wb->rc = -1;
+    if (wb->outstanding == 0) {
+      free(wb);
+    }
+  }
+  return rc;
+}
+
+/* Leaves |req|, which needs nothing more from the server, to the next mdadm_poll. */
+static void make_ready(async_req_t *req) {
+  req->next = NULL;
+  if (ready_tail) {
+    ready_tail->next = req;
+  } else {
+    ready_head = req;
+  }
+  ready_tail = req;
+}
+
+/* Sends the asynchronous queue in one sweep if the connection is down to
+ * SCHED_LOW_WATER operations in flight, and then as much of what is queued on
+ * the event loop as the socket takes. */
+static void send_async(void) {
+  if (async_queue.len > 0 && jbod_conn_in_flight(chan_conn()) <= SCHED_LOW_WATER) {
+    dispatch(&async_queue);
+  }
+  jbod_conn_send_async(chan_conn());
+}
+
+/* Sets up and starts an asynchronous request. Returns its id, or -1 if it was
+ * not accepted. */
+static int start_async(uint32_t addr, uint32_t len, uint8_t *buf, bool is_write,
+                       mdadm_callback_t cb, void *arg) {
+  if (!valid_request(addr, len, buf) || chan != &main_chan) {
+    return -1;
+  }
+  async_req_t *req = calloc(1, sizeof(async_req_t));
+  if (req == NULL) {
+    return -1;
+  }
+  req->id = next_request_id++;
+  if (next_request_id <= 0) {
+    next_request_id = 1;
+  }
+  req->is_write = is_write;
+  req->addr = addr;
+  req->len = len;
+  req->buf = buf;
+  req->cb = cb;
+  req->arg = arg;
+  req->rc = 1;
+  req->started_ns = stats_now_ns();
+  num_async++;
+  int id = req->id;
+
+  bool was_serving = serving_async;
+  serving_async = true;
+  async_target = req;
+  if (queue_async_reads(req) == -1) {
+    req->rc = -1;
+  }
+  async_target = NULL;
+  // A write with no partial blocks to read can go straight on to writing.
+  if (req->outstanding == 0 && is_write && req->rc == 1) {
+    advance_async(req);
+  } else if (req->outstanding == 0) {
+    // Everything came from the cache; the callback waits for mdadm_poll.
+    make_ready(req);
+  }
+  serving_async = was_serving;
+
+  // Get the requests on their way while the caller gets on with something else
+  send_async();
+  return id;
+}
+
+int mdadm_read_async(uint32_t addr, uint32_t len, uint8_t *buf, mdadm_callback_t cb, void *arg) {
+  return start_async(addr, len, buf, false, cb, arg);
+}
+
+int mdadm_write_async(uint32_t addr, uint32_t len, const uint8_t *buf, mdadm_callback_t cb, void *arg) {
+  // The buffer is only read from for a write, so dropping const is safe.
+  return start_async(addr, len, (uint8_t *)buf, true, cb, arg);
+}
+
+int mdadm_poll(int timeout_ms) {
+  if (chan != &main_chan) {
+    return -1;
+  }
+  long finished = num_async_finished;
+  bool was_serving = serving_async;
+  serving_async = true;
+
+  // Requests the cache served finish first, and the wait is skipped if there were any.
+  while (ready_head != NULL) {
+    async_req_t *req = ready_head;
+    ready_head = req->next;
+    if (ready_head == NULL) {
+      ready_tail = NULL;
+    }
+    finish_async(req);
+  }
+  int rc = 0;
+  send_async();
+  if (jbod_conn_in_flight(chan_conn()) > 0) {
+    rc = jbod_conn_poll(chan_conn(), num_async_finished > finished ? 0 : timeout_ms);
+    // The batch may be done now, and the callbacks may have queued more
+    send_async();
+  }
+
+  serving_async = was_serving;
+  return rc == -1 ? -1 : (int) (num_async_finished - finished);
+}
+
+int mdadm_async_pending(void) {
+  return num_async;
+}
+
+int mdadm_async_drain(void) {
+  if (chan != &main_chan) {
+    return -1;
+  }
+  int rc = 1;
+  while (ready_head != NULL || async_queue.len > 0 || jbod_conn_in_flight(chan_conn()) > 0) {
+    if (mdadm_poll(-1) == -1) {
+      rc = -1;
+    }
+  }
+  if (async_writeback_failed) {
+    async_writeback_failed = false;
+    rc = -1;
+  }
+  return rc;
+}
+
+/* Readies the calling thread for a synchronous call: not from an asynchronous
+ * callback, and only after the asynchronous requests in flight are done.
+ * Returns 1 on success and -1 on failure. */
+static int sync_barrier(void) {
+  if (serving_async) {
+    return -1;
+  }
+  if (chan == &main_chan && (ready_head != NULL || async_queue.len > 0 || jbod_conn_in_flight(chan_conn()) > 0)) {
+    return mdadm_async_drain();
+  }
+  return 1;
+}
+
+int mdadm_read(uint32_t addr, uint32_t len, uint8_t *buf) {
+  if (!valid_request(addr, len, buf) || len > MDADM_MAX_IO_SIZE) { //this checks if the mount status and inputs are valid
+    return -1; //returns -1 if not mounted, not in the correct bytes range, or the buf is NULL
+  }
+  return mdadm_stream_read(addr, len, buf);
+}
+
+int mdadm_write(uint32_t addr, uint32_t len, const uint8_t *buf) {
+  if (!valid_request(addr, len, buf) || len > MDADM_MAX_IO_SIZE) {
+    return -1;
+  }
+  return mdadm_stream_write(addr, len, buf);
+}
+
+int mdadm_stream_read(uint32_t addr, uint32_t len, uint8_t *buf) {
+  if (!valid_request(addr, len, buf) || sync_barrier() == -1) {
+    return -1;
+  }
+  uint64_t started = stats_now_ns();
+  int rc;
+  if (spans_disks(addr, len)) {
+    rc = fan_out(addr, len, buf, false, disks_touched(addr, len));
+  } else {
+    rc = read_range(addr, len, buf, ALL_DISKS);
+  }
+  count_request(false, len, rc == -1 ? -1 : 1, started);
+  return rc;
+}
+
+int mdadm_stream_write(uint32_t addr, uint32_t len, const uint8_t *buf) {
+  if (!valid_request(addr, len, buf) || sync_barrier() == -1) {
+    return -1;
+  }
+  uint64_t started = stats_now_ns();
+  int rc;
+  // Workers only read from a buffer being written, so dropping const is safe.
+  if (spans_disks(addr, len)) {
+    rc = fan_out(addr, len, (uint8_t *)buf, true, disks_touched(addr, len));
+  } else {
+    rc = write_range(addr, len, buf, ALL_DISKS);
+  }
+  count_request(true, len, rc == -1 ? -1 : 1, started);
+  return rc;
+}
+
+void mdadm_get_stats(mdadm_stats_t *stats) {
+  stats->reads = num_reads;
+  stats->writes = num_writes;
+  stats->failed = num_failed;
+  stats->bytes_read = bytes_read;
+  stats->bytes_written = bytes_written;
+  stats->seeks_issued = seeks_issued;
+  stats->seeks_skipped = seeks_skipped;
+  stats_hist_copy(&stats->read_latency, &read_latency);
+  stats_hist_copy(&stats->write_latency, &write_latency);
+}
@@ -1,19 +1,125 @@
 #ifndef MDADM_H_
 #define MDADM_H_
 
+#include <stdbool.h>
 #include <stdint.h>
 #include "jbod.h"
+#include "stats.h"
+
+/* Size of the linear volume made of all the disks, in bytes */
+#define MDADM_VOLUME_SIZE (JBOD_NUM_DISKS * JBOD_DISK_SIZE)
+
+/* Largest request mdadm_read and mdadm_write accept, in bytes */
+#define MDADM_MAX_IO_SIZE 1024
+
+/* How volume addresses map onto the disks */
+typedef enum {
+  MDADM_LINEAR,  /* the disks one after the other, the default */
+  MDADM_STRIPED, /* RAID-0: consecutive stripe units rotate across the disks */
+} mdadm_layout_t;
+
+/* Return 1 on success and -1 on failure. Selects the layout, and for
+ * MDADM_STRIPED the stripe unit in bytes: a power of two from JBOD_BLOCK_SIZE
+ * to JBOD_DISK_SIZE. Fails while mounted, since it moves every block. */
+int mdadm_set_layout(mdadm_layout_t layout, int stripe_unit);
+
+/* Returns the volume address of block |block_num| of disk |disk_num| under the
+ * current layout. */
+uint32_t mdadm_block_addr(int disk_num, int block_num);
 
 /* Return 1 on success and -1 on failure */
 int mdadm_mount(void);
 
-/* Return 1 on success and -1 on failure */
+/* Return 1 on success and -1 on failure. Flushes dirty cache blocks first.
+ * With a block map file set (see blockmap_set), -1 after the volume is
+ * unmounted means the map could not be saved. */
 int mdadm_unmount(void);
 
+/* Largest readahead window mdadm_set_readahead accepts, in blocks */
+#define MDADM_READAHEAD_MAX 64
+
+/* Return 1 on success and -1 on failure. Sets the most blocks mdadm_read reads
+ * into the cache ahead of a sequential stream of reads on a disk; 0, the
+ * default, turns readahead off. Has no effect while the cache is disabled. */
+int mdadm_set_readahead(int max_blocks);
+
+/* Turns write-back caching on or off. When on, writes only update the cache
+ * and reach the server on eviction, cache_flush or mdadm_unmount. Has no
+ * effect while the cache is disabled. */
+void mdadm_set_write_back(bool enabled);
+
+/* Return 1 on success and -1 on failure. Gives the calling thread a
+ * connection of its own, opened with jbod_conn_open, so that it can call
+ * mdadm_read, mdadm_write and the stream functions while other threads do.
+ * The thread that called jbod_connect uses that connection and need not
+ * attach. mdadm_thread_detach closes the connection again. Mounting,
+ * unmounting and changing settings must not overlap with I/O. */
+int mdadm_thread_attach(void);
+void mdadm_thread_detach(void);
+
 /* Return the number of bytes read on success, -1 on failure. */
 int mdadm_read(uint32_t addr, uint32_t len, uint8_t *buf);
 
 /* Return the number of bytes written on success, -1 on failure. */
 int mdadm_write(uint32_t addr, uint32_t len, const uint8_t *buf);
 
+/* Like mdadm_read and mdadm_write, for ranges of any length up to the whole
+ * volume and across disk boundaries. Each contiguous run of blocks costs one
+ * seek, and reads land in |buf| without an intermediate copy.
+ *
+ * If jbod_connect_pool opened connections before mdadm_mount, a request that
+ * spans several disks is split at the disk boundaries and the parts run
+ * concurrently, one worker thread per pooled connection. */
+int mdadm_stream_read(uint32_t addr, uint32_t len, uint8_t *buf);
+int mdadm_stream_write(uint32_t addr, uint32_t len, const uint8_t *buf);
+
+/* Called when an asynchronous request |id| is done, with |result| the number
+ * of bytes read or written, or -1 on failure, and the |arg| it was given. */
+typedef void (*mdadm_callback_t)(int id, int result, void *arg);
+
+/* Asynchronous mdadm_stream_read and mdadm_stream_write: they queue the
+ * request on an epoll event loop over the connection from jbod_connect and
+ * return its id (a positive number) at once, or -1 if it is not accepted.
+ * |buf| must stay untouched until the callback, which mdadm_poll makes.
+ * While the connection is busy their reads and writes are held back, then
+ * sent together sorted by disk and block, so the more requests are in
+ * flight, the fewer seeks each costs. Requests in flight together complete
+ * in no particular order, so one that
+ * overlaps another in flight (even in a different part of the same block)
+ * must wait for its callback. Async reads do not read ahead. Only the thread
+ * that called jbod_connect may use these, and a callback may queue more
+ * requests but must not call the synchronous functions; those first wait for
+ * every request in flight. */
+int mdadm_read_async(uint32_t addr, uint32_t len, uint8_t *buf, mdadm_callback_t cb, void *arg);
+int mdadm_write_async(uint32_t addr, uint32_t len, const uint8_t *buf, mdadm_callback_t cb, void *arg);
+
+/* Runs the event loop, waiting up to |timeout_ms| (-1 for no limit) for
+ * replies, and makes the callbacks of the requests that are done. Returns how
+ * many requests completed, or -1 if the connection failed. */
+int mdadm_poll(int timeout_ms);
+
+/* Returns the number of asynchronous requests not yet called back. */
+int mdadm_async_pending(void);
+
+/* Polls until every asynchronous request, and every dirty block written back
+ * on their behalf, is done. Returns 1 on success and -1 if any write-back or
+ * the connection failed. */
+int mdadm_async_drain(void);
+
+/* What the reads and writes have done since the program started */
+typedef struct {
+  uint64_t reads;          /* reads that succeeded, synchronous or not */
+  uint64_t writes;         /* writes that succeeded, synchronous or not */
+  uint64_t failed;         /* reads and writes that failed */
+  uint64_t bytes_read;
+  uint64_t bytes_written;
+  uint64_t seeks_issued;   /* SEEK_TO_DISK and SEEK_TO_BLOCK commands sent */
+  uint64_t seeks_skipped;  /* seeks left out because the head was already there */
+  stats_hist_t read_latency;  /* of successful reads, from call to return or callback */
+  stats_hist_t write_latency; /* of successful writes, likewise */
+} mdadm_stats_t;
+
+/* Fills in |stats|. Safe to call while other threads are reading and writing. */
+void mdadm_get_stats(mdadm_stats_t *stats);
+
 #endif
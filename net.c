@@ -7,154 +7,222 @@
 #include <err.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/time.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <stdatomic.h>
 #include "net.h"
 #include "jbod.h"
+#include "stats.h"
+#include "shm.h"
+
+/* the command field of a JBOD opcode (see use_addr in mdadm.c) */
+#define OP_CMD(op) (((op) >> 14) & 0x3f)
+
+/* An operation queued by jbod_conn_submit_async, waiting to be sent or for its reply */
+typedef struct {
+    uint32_t op;
+    uint8_t *block;
+    jbod_done_fn done;
+    void *tag;
+    uint64_t submitted_ns;                               // when it was queued, for its round trip
+    uint8_t request_header[HEADER_LEN];
+    uint8_t reply_header[HEADER_LEN];
+} async_op_t;
+
+/* Most replies one pass of the event loop takes in */
+#define ASYNC_BATCH 64
+
+/* How long a new pooled or per-thread connection waits for the server to answer
+its handshake */
+#define HANDSHAKE_TIMEOUT_MS 2000
+
+/* A connection to the server and the operations queued on it by
+jbod_conn_submit. Only the headers live here: a block is sent from, or received
+into, the caller's buffer in place, and the request and reply headers are reused
+for every batch, so the packet path never allocates or copies a block. A
+connection to shm_server has no socket; its packets go through the rings of a
+shared-memory region instead (see shm.h), a block copied in or out of a slot. */
+struct jbod_conn {
+    int sd;                                              // the socket descriptor, or -1
+    shm_region_t *shm;                                   // the shared-memory region, or NULL
+    uint32_t pending_ops[JBOD_PIPELINE_DEPTH];
+    uint8_t *pending_blocks[JBOD_PIPELINE_DEPTH];
+    uint8_t request_headers[JBOD_PIPELINE_DEPTH][HEADER_LEN];
+    uint8_t reply_headers[JBOD_PIPELINE_DEPTH][HEADER_LEN];
+    int num_pending;
+    uint8_t discard_block[JBOD_BLOCK_SIZE];              // where reply blocks nobody asked for go
+    unsigned long num_syscalls;                          // socket system calls made
+    unsigned long num_ops;                               // JBOD operations completed
+
+    /* Asynchronous operations, oldest first, in a ring that grows as needed.
+    The first async_sent of them have gone out, and send_off bytes of the
+    next; recv_off bytes of the oldest one's reply have come in. */
+    async_op_t *async_ops;
+    int async_cap;
+    int async_head;
+    int async_count;
+    int async_sent;
+    size_t send_off;
+    size_t recv_off;
+    int epfd;                                            // epoll instance, or -1 until first needed
+    uint32_t ep_events;                                  // what epfd waits for on sd
+    bool dispatching;                                    // running completion callbacks
+};
+
+/* the connection jbod_connect opens, used by the jbod_client_* calls */
+static jbod_conn_t cli_conn = { .sd = -1 };
+
+/* the extra connections jbod_connect_pool opens */
+static jbod_conn_t pool_conns[JBOD_MAX_POOL_CONNS];
+static int pool_size = 0;
+
+/* where jbod_connect connected to, for jbod_conn_open: an address, or a
+shared-memory name after JBOD_SHM_PREFIX */
+static char server_ip[256];
+static uint16_t server_port;
+
+/* what connections closed by jbod_conn_close counted, for jbod_print_syscalls_per_op */
+static atomic_ulong closed_syscalls = 0;
+static atomic_ulong closed_ops = 0;
+
+/* what every connection has done, for jbod_get_stats */
+static atomic_ulong cmd_counts[JBOD_NUM_CMDS];
+static atomic_ulong num_failed = 0;
+static atomic_ulong bytes_sent = 0;
+static atomic_ulong bytes_received = 0;
+static stats_hist_t round_trips;
+
+/* Drops the first |n| bytes of the |*iovcnt| buffers at |*iov|, advancing past
+the buffers that are used up and trimming the one that is not. */
+static void iov_advance(struct iovec **iov, int *iovcnt, size_t n) {
+    while (*iovcnt > 0 && n >= (*iov)->iov_len) {
+        n -= (*iov)->iov_len;
+        (*iov)++;
+        (*iovcnt)--;
+    }
+    if (*iovcnt > 0) {
+        (*iov)->iov_base = (uint8_t *)(*iov)->iov_base + n;
+        (*iov)->iov_len -= n;
+    }
+}
 
-/* the client socket descriptor for the connection to the server */
-int cli_sd = -1;
+/* asks for quick-ack mode again on |conn|, before a read that will wait for
+the server (see open_conn). The mode wears off, but a read that finds its
+replies already there has nothing to acknowledge in a hurry.
+*/
+static void rearm_quickack(jbod_conn_t *conn) {
+    int one = 1;
+    setsockopt(conn->sd, IPPROTO_TCP, TCP_QUICKACK, &one, sizeof(one));
+    conn->num_syscalls++;
+}
 
-/* attempts to read n (len) bytes from fd; returns true on success and false on failure. 
-It may need to call the system call "read" multiple times to reach the given size len. 
+/* attempts to fill the |iovcnt| buffers at |iov| from the connection; returns true on success and false on failure.
+It may need to call the system call "readv" multiple times, as the replies to a
+batch arrive over time. |iov| is consumed in the process.
 */
-static bool nread(int fd, int len, uint8_t *buf) {
-    int bytesRead, totalBytesRead = 0; // bytesRead: Number of bytes read in a single read operation, totalBytesRead: Cumulative count of bytes read
+static bool nreadv(jbod_conn_t *conn, struct iovec *iov, int iovcnt) {
+    for (bool first = true; iovcnt > 0; first = false) {
+        // After a short read the rest of the batch is still on its way
+        if (!first) {
+            rearm_quickack(conn);
+        }
 
-    // Continuously read until the totalBytesRead matches the length required
-    while (totalBytesRead < len) {
-        // Read data from file descriptor into the buffer at the position indicated by totalBytesRead
-        // The amount of data to be read is reduced by the totalBytesRead already achieved
-        bytesRead = read(fd, buf + totalBytesRead, len - totalBytesRead);
+        // Read whatever has arrived, scattered across the remaining buffers
+        ssize_t bytesRead = readv(conn->sd, iov, iovcnt);
+        conn->num_syscalls++;
 
         // Check if the read operation was successful
-        if (bytesRead < 0) {
-            return false; // Return false if an error occurred during read
+        if (bytesRead <= 0) {
+            return false; // Return false if an error occurred during read, or the server closed the connection
         }
-        // Update the total number of bytes read after a successful read operation
-        totalBytesRead += bytesRead;
+        bytes_received += bytesRead;
+        iov_advance(&iov, &iovcnt, bytesRead);
     }
-    return true; // Return true once the requested number of bytes has been read successfully
+    return true; // Return true once every buffer has been filled
 }
 
-/* attempts to write n bytes to fd; returns true on success and false on failure 
-It may need to call the system call "write" multiple times to reach the size len.
+/* attempts to write the |iovcnt| buffers at |iov| to the connection; returns true on success and false on failure.
+It may need to call the system call "writev" multiple times if the socket takes
+only part of the data. |iov| is consumed in the process.
 */
-static bool nwrite(int fd, int len, uint8_t *buf) {
-    int bytesWritten, totalWritten = 0;  // bytesWritten: stores number of bytes written in each write call, totalWritten: cumulative number of bytes written
+static bool nwritev(jbod_conn_t *conn, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        // Attempt to write the remaining data to the socket
+        ssize_t bytesWritten = writev(conn->sd, iov, iovcnt);
+        conn->num_syscalls++;
 
-    // Continue writing until all requested bytes are written
-    while (totalWritten < len) {
-        // Attempt to write the remaining data to the file descriptor
-        bytesWritten = write(fd, buf + totalWritten, len - totalWritten);
         // Check if the write operation was successful
         if (bytesWritten < 0) {
             return false; // If an error occurred during writing, return false
         }
-        // Update the total number of bytes written
-        totalWritten += bytesWritten;
+        bytes_sent += bytesWritten;
+        iov_advance(&iov, &iovcnt, bytesWritten);
     }
-
     return true; // Return true once all data has been successfully written
 }
 
+/* Returns true if the reply to |op| carries a block after its header: the server
+answers JBOD_READ_BLOCK and JBOD_SIGN_BLOCK with one (even when they fail), and
+nothing else. */
+static bool reply_has_block(uint32_t op) {
+    return OP_CMD(op) == JBOD_READ_BLOCK || OP_CMD(op) == JBOD_SIGN_BLOCK;
+}
 
-/* Through this function call the client attempts to receive a packet from sd 
-(i.e., receiving a response from the server.). It happens after the client previously 
-forwarded a jbod operation call via a request message to the server.  
-It returns true on success and false on failure. 
-The values of the parameters (including op, ret, block) will be returned to the caller of this function: 
+/* Unpacks a jbod response header. The values of the parameters will be returned to the caller:
 
-op - the address to store the jbod "opcode"  
+len - the address to store the packet length
+op - the address to store the jbod "opcode"
 ret - the address to store the return value of the server side calling the corresponding jbod_operation function.
-block - holds the received block content if existing (e.g., when the op command is JBOD_READ_BLOCK)
-
-In your implementation, you can read the packet header first (i.e., read HEADER_LEN bytes first), 
-and then use the length field in the header to determine whether it is needed to read 
-a block of data from the server. You may use the above nread function here.  
 */
-static bool recv_packet(int sd, uint32_t *op, uint16_t *ret, uint8_t *block) {
-  // Define a buffer for the packet header, header_packet
-  uint8_t header_packet[HEADER_LEN];
-
-  // Read the header from the socket
-  if (!nread(sd, HEADER_LEN, header_packet))
-    return false;  // Return false if reading the header fails
-
+static void unpack_header(const uint8_t *header, uint16_t *len, uint32_t *op, uint16_t *ret) {
   // Extract packet length, operation code, and return value from the header
-  uint16_t len;
-  memcpy(&len, header_packet, sizeof(uint16_t));        // Copy the packet length
-  memcpy(op, header_packet + 2, sizeof(uint32_t));      // Copy the operation code
-  memcpy(ret, header_packet + 6, sizeof(uint16_t));     // Copy the return value
+  memcpy(len, header, sizeof(uint16_t));        // Copy the packet length
+  memcpy(op, header + 2, sizeof(uint32_t));     // Copy the operation code
+  memcpy(ret, header + 6, sizeof(uint16_t));    // Copy the return value
 
   // Convert network byte order to host byte order
   *op = ntohl(*op);  // Convert operation code
   *ret = ntohs(*ret); // Convert return value
-  len = ntohs(len);  // Convert packet length
-
-  // Check if there's additional data beyond the header to read (e.g., a data block)
-  if (len > HEADER_LEN) {
-    // If additional data is present, read it into the provided 'block' buffer
-    return nread(sd, JBOD_BLOCK_SIZE, block);
-  }
-
-  // If no additional data needs to be read, return true
-  return true;
+  *len = ntohs(*len);  // Convert packet length
 }
 
+/* Packs a jbod request header for |op| into |header| and returns the length
+of the whole packet.
 
-/* The client attempts to send a jbod request packet to sd (i.e., the server socket here); 
-returns true on success and false on failure. 
+op - the opcode.
+has_block - whether a block follows the header; only JBOD_WRITE_BLOCK sends one.
 
-op - the opcode. 
-block- when the command is JBOD_WRITE_BLOCK, the block will contain data to write to the server jbod system;
-otherwise it is NULL.
-
-The above information (when applicable) has to be wrapped into a jbod request packet (format specified in readme).
-You may call the above nwrite function to do the actual sending.  
+The packet format is specified in the readme.
 */
-
-static bool send_packet(int sd, uint32_t op, uint8_t *block) {
-    // Determine the packet length based on whether a data block needs to be included
-    uint16_t len = HEADER_LEN + (block ? JBOD_BLOCK_SIZE : 0);
+static uint16_t pack_header(uint8_t *header, uint32_t op, bool has_block) {
+    uint16_t len = HEADER_LEN + (has_block ? JBOD_BLOCK_SIZE : 0);
 
     // Convert total length and operation code to network byte order upfront
     uint16_t length_of_packet = htons(len);
     uint32_t op_of_packet = htonl(op);
+    uint16_t ret_of_packet = 0;
 
-    // Allocate memory for the packet
-    uint8_t *packet = malloc(len);
-    if (!packet) {
-        return false; // Return false if memory allocation fails
-    }
-
-    // Pack the header: start with length and then operation code
-    memcpy(packet, &length_of_packet, sizeof(uint16_t));
-    memcpy(packet + 2, &op_of_packet, sizeof(uint32_t));
-
-    // If a data block is to be included, append it after the header
-    if (block) {
-        memcpy(packet + HEADER_LEN, block, JBOD_BLOCK_SIZE);
-    }
-
-    // Send the packet and clean up
-    bool success = nwrite(sd, len, packet);
-    free(packet); // Always free the allocated memory after the packet is sent or in case of failure
-    return success;
+    // Pack the header: length, operation code and an empty return code
+    memcpy(header, &length_of_packet, sizeof(uint16_t));
+    memcpy(header + 2, &op_of_packet, sizeof(uint32_t));
+    memcpy(header + 6, &ret_of_packet, sizeof(uint16_t));
+    return len;
 }
 
-/* attempts to connect to server and set the global cli_sd variable to the
- * socket; returns true if successful and false if not. 
- * this function will be invoked by tester to connect to the server at given ip and port.
- * you will not call it in mdadm.c
-*/
-bool jbod_connect(const char *ip, uint16_t port) {
+/* attempts to connect to the server at the given ip and port; returns the
+socket descriptor if successful and -1 if not. */
+static int open_socket(const char *ip, uint16_t port) {
     // Define the server address structure
-    struct sockaddr_in caddr; 
+    struct sockaddr_in caddr;
 
     // Attempt to create a socket for IPv4 and TCP communication
-    cli_sd = socket(AF_INET, SOCK_STREAM, 0);
-    if (cli_sd < 0) {
-        return false; // Exit if the socket could not be created
+    int sd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sd < 0) {
+        return -1; // Exit if the socket could not be created
     }
 
     // Initialize the address structure
@@ -164,47 +232,712 @@ bool jbod_connect(const char *ip, uint16_t port) {
 
     // Convert IP address from text to binary form and set it
     if (inet_pton(AF_INET, ip, &caddr.sin_addr) <= 0) {
-        close(cli_sd); // Ensure to close socket on failure
-        return false;  // Exit if the IP address is invalid
+        close(sd); // Ensure to close socket on failure
+        return -1;  // Exit if the IP address is invalid
     }
 
     // Establish a connection to the specified IP address and port
-    if (connect(cli_sd, (struct sockaddr *)&caddr, sizeof(caddr)) < 0) {
-        close(cli_sd); // Ensure to close socket on failure
-        return false;  // Exit if connection cannot be established
+    if (connect(sd, (struct sockaddr *)&caddr, sizeof(caddr)) < 0) {
+        close(sd); // Ensure to close socket on failure
+        return -1;  // Exit if connection cannot be established
+    }
+
+    // Requests are pipelined, so the server answers several of them back to back.
+    // Acknowledge its replies right away, or its Nagle algorithm holds each later
+    // reply back until our delayed ACK fires; the reads ask for this again
+    // whenever they have to wait (see rearm_quickack).
+    int one = 1;
+    setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(sd, IPPROTO_TCP, TCP_QUICKACK, &one, sizeof(one));
+    return sd;
+}
+
+/* checks that the server serves the socket |sd| by sending it a JBOD_SIGN_BLOCK,
+which changes nothing, and waiting up to HANDSHAKE_TIMEOUT_MS for the reply;
+returns true if it came. A server that serves one client at a time, such as
+jbod_server, accepts another connection but never reads from it, and every
+request on it would wait forever. */
+static bool handshake(int sd) {
+    uint8_t header[HEADER_LEN];
+    uint8_t reply[HEADER_LEN + JBOD_BLOCK_SIZE];
+    uint16_t len = pack_header(header, (uint32_t) JBOD_SIGN_BLOCK << 14, false);
+    struct timeval timeout = { HANDSHAKE_TIMEOUT_MS / 1000, (HANDSHAKE_TIMEOUT_MS % 1000) * 1000 };
+    if (setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == -1 ||
+        write(sd, header, len) != len ||
+        recv(sd, reply, sizeof(reply), MSG_WAITALL) != (ssize_t) sizeof(reply)) {
+        return false;
+    }
+    // Requests after this wait as long as the server takes
+    timeout = (struct timeval){ 0, 0 };
+    return setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == 0;
+}
+
+/* returns true if |conn| is connected, over either transport */
+static bool conn_is_open(const jbod_conn_t *conn) {
+    return conn->sd != -1 || conn->shm != NULL;
+}
+
+/* attempts to connect |conn| to the server at the given ip and port, or to
+shm_server if |ip| is JBOD_SHM_PREFIX and its name; returns true if successful
+and false if not. */
+static bool open_conn(jbod_conn_t *conn, const char *ip, uint16_t port) {
+    conn->sd = -1;
+    conn->shm = NULL;
+    if (strncmp(ip, JBOD_SHM_PREFIX, strlen(JBOD_SHM_PREFIX)) == 0) {
+        conn->shm = shm_attach(ip + strlen(JBOD_SHM_PREFIX));
+        if (conn->shm == NULL) {
+            return false;
+        }
+    } else if ((conn->sd = open_socket(ip, port)) == -1) {
+        return false;
     }
 
     // Connection successfully established
+    conn->num_pending = 0;
+    conn->async_ops = NULL;
+    conn->async_cap = 0;
+    conn->async_head = 0;
+    conn->async_count = 0;
+    conn->async_sent = 0;
+    conn->send_off = 0;
+    conn->recv_off = 0;
+    conn->epfd = -1;
+    conn->ep_events = 0;
+    conn->dispatching = false;
     return true;
 }
 
-/* disconnects from the server and resets cli_sd */
+/* closes |conn|, dropping anything still queued on it */
+static void close_conn(jbod_conn_t *conn) {
+    if (conn->sd != -1) {
+        close(conn->sd);
+        if (conn->epfd != -1) {
+            close(conn->epfd);
+        }
+    }
+    if (conn->shm != NULL) {
+        shm_detach(conn->shm);
+    }
+    conn->sd = -1;
+    conn->shm = NULL;
+    conn->num_pending = 0;
+    free(conn->async_ops);
+    conn->async_ops = NULL;
+    conn->async_count = 0;
+    conn->epfd = -1;
+}
+
+/* attempts to connect to server and set up the connection the jbod_client_*
+ * calls use; returns true if successful and false if not.
+ * this function will be invoked by tester to connect to the server at given ip and port.
+ * you will not call it in mdadm.c
+*/
+bool jbod_connect(const char *ip, uint16_t port) {
+    if (!open_conn(&cli_conn, ip, port)) {
+        return false;
+    }
+    snprintf(server_ip, sizeof(server_ip), "%s", ip);
+    server_port = port;
+    return true;
+}
+
+/* disconnects from the server, closing the pool as well */
 void jbod_disconnect(void) {
-	close(cli_sd);
-	cli_sd = -1;
+    close_conn(&cli_conn);
+    for (int i = 0; i < pool_size; i++) {
+        close_conn(&pool_conns[i]);
+    }
+    pool_size = 0;
+}
+
+/* opens the pooled connections; on failure the ones already open are closed again */
+bool jbod_connect_pool(const char *ip, uint16_t port, int num_conns) {
+    if (num_conns < 1 || num_conns > JBOD_MAX_POOL_CONNS || pool_size != 0) {
+        return false;
+    }
+    for (int i = 0; i < num_conns; i++) {
+        bool ok = open_conn(&pool_conns[i], ip, port);
+        if (ok && pool_conns[i].sd != -1 && !handshake(pool_conns[i].sd)) {
+            close_conn(&pool_conns[i]);
+            ok = false;
+        }
+        if (!ok) {
+            for (int j = 0; j < i; j++) {
+                close_conn(&pool_conns[j]);
+            }
+            return false;
+        }
+    }
+    pool_size = num_conns;
+    return true;
 }
 
-/* sends the JBOD operation to the server (use the send_packet function) and receives 
-(use the recv_packet function) and processes the response. 
+int jbod_pool_size(void) {
+    return pool_size;
+}
 
-The meaning of each parameter is the same as in the original jbod_operation function. 
-return: 0 means success, -1 means failure.
-*/
-int jbod_client_operation(uint32_t op, uint8_t *block) {
-// Send a packet to the server. Return -1 on failure.
-if (!send_packet(cli_sd, op, block)) {
-    return -1;
+jbod_conn_t *jbod_pool_conn(int i) {
+    return (i >= 0 && i < pool_size) ? &pool_conns[i] : NULL;
+}
+
+jbod_conn_t *jbod_client_conn(void) {
+    return &cli_conn;
+}
+
+jbod_conn_t *jbod_conn_open(void) {
+    if (!conn_is_open(&cli_conn)) {
+        return NULL; // jbod_connect has not said where the server is
+    }
+    jbod_conn_t *conn = malloc(sizeof(jbod_conn_t));
+    if (conn == NULL) {
+        return NULL;
+    }
+    if (!open_conn(conn, server_ip, server_port)) {
+        free(conn);
+        return NULL;
+    }
+    if (conn->sd != -1 && !handshake(conn->sd)) {
+        close_conn(conn);
+        free(conn);
+        return NULL;
+    }
+    conn->num_syscalls = 0;
+    conn->num_ops = 0;
+    return conn;
+}
+
+void jbod_conn_close(jbod_conn_t *conn) {
+    if (conn == NULL) {
+        return;
+    }
+    closed_syscalls += conn->num_syscalls;
+    closed_ops += conn->num_ops;
+    close_conn(conn);
+    free(conn);
+}
+
+/* queues the JBOD operation. Nothing is copied, so |block| has to stay valid,
+and unchanged if it is being written, until jbod_conn_complete. */
+int jbod_conn_submit(jbod_conn_t *conn, uint32_t op, uint8_t *block) {
+    // A full queue has to go out before another request fits
+    if (conn->num_pending == JBOD_PIPELINE_DEPTH && jbod_conn_complete(conn) == -1) {
+        return -1;
+    }
+
+    conn->pending_ops[conn->num_pending] = op;
+    conn->pending_blocks[conn->num_pending] = block;
+    conn->num_pending++;
+    return 0;
+}
+
+/* jbod_conn_complete over shared memory: copies the |count| queued requests
+into the request ring at once, then takes their replies off the reply ring as
+shm_server answers them, copying out the blocks of those that carry one. */
+static int complete_shm(jbod_conn_t *conn, int count, uint64_t started) {
+    shm_region_t *shm = conn->shm;
+
+    // Between batches the rings are empty, and a batch fits in one
+    if (shm_ring_space(&shm->requests) < (uint32_t) count) {
+        return -1;
+    }
+    size_t sent = 0;
+    for (int i = 0; i < count; i++) {
+        shm_slot_t *slot = shm_ring_free_slot(&shm->requests, i);
+        slot->op = conn->pending_ops[i];
+        sent += HEADER_LEN;
+        if (OP_CMD(slot->op) == JBOD_WRITE_BLOCK && conn->pending_blocks[i] != NULL) {
+            memcpy(slot->block, conn->pending_blocks[i], JBOD_BLOCK_SIZE);
+            sent += JBOD_BLOCK_SIZE;
+        }
+    }
+    bytes_sent += sent;
+    conn->num_syscalls += shm_ring_publish(&shm->requests, count);
+
+    // Take the replies in as they come. One for another operation means the
+    // rings are out of step with the requests, which cannot be recovered from.
+    int rc = 0;
+    size_t received = 0;
+    for (int done = 0; done < count;) {
+        if (shm_ring_wait_ready(&shm->replies, -1, shm->server_pid, &conn->num_syscalls) != 1) {
+            return -1;
+        }
+        uint32_t ready = shm_ring_ready(&shm->replies);
+        if (ready > (uint32_t) (count - done)) {
+            ready = count - done;
+        }
+        for (uint32_t j = 0; j < ready; j++, done++) {
+            shm_slot_t *slot = shm_ring_ready_slot(&shm->replies, j);
+            if (slot->op != conn->pending_ops[done]) {
+                return -1;
+            }
+            received += HEADER_LEN;
+            if (reply_has_block(slot->op)) {
+                if (conn->pending_blocks[done] != NULL) {
+                    memcpy(conn->pending_blocks[done], slot->block, JBOD_BLOCK_SIZE);
+                }
+                received += JBOD_BLOCK_SIZE;
+            }
+            if (slot->ret != 0) {
+                rc = -1;
+                num_failed++;
+            }
+        }
+        conn->num_syscalls += shm_ring_release(&shm->replies, ready);
+    }
+    bytes_received += received;
+    stats_hist_record(&round_trips, started);
+    return rc;
+}
+
+/* sends all queued requests with one writev and then gathers their responses,
+which the server sends back in request order, with as few readv calls as the
+data arriving allows. */
+int jbod_conn_complete(jbod_conn_t *conn) {
+    // Asynchronous operations went first, so their replies come first. A
+    // completion callback cannot wait for them, since they are its caller's.
+    if (conn->async_count > 0 && (conn->dispatching || jbod_conn_drain(conn) == -1)) {
+        conn->num_pending = 0;
+        return -1;
+    }
+
+    int count = conn->num_pending;
+    conn->num_pending = 0;
+    if (count == 0) {
+        return 0;
+    }
+    conn->num_ops += count;
+    for (int i = 0; i < count; i++) {
+        cmd_counts[OP_CMD(conn->pending_ops[i])]++;
+    }
+    uint64_t started = stats_now_ns();
+    if (conn->shm != NULL) {
+        return complete_shm(conn, count, started);
+    }
+
+    // Lay out every request as its header followed, for a write, by the caller's block
+    struct iovec iov[2 * JBOD_PIPELINE_DEPTH];
+    int iovcnt = 0;
+    for (int i = 0; i < count; i++) {
+        bool has_block = (OP_CMD(conn->pending_ops[i]) == JBOD_WRITE_BLOCK && conn->pending_blocks[i] != NULL);
+        pack_header(conn->request_headers[i], conn->pending_ops[i], has_block);
+        iov[iovcnt++] = (struct iovec){ conn->request_headers[i], HEADER_LEN };
+        if (has_block) {
+            iov[iovcnt++] = (struct iovec){ conn->pending_blocks[i], JBOD_BLOCK_SIZE };
+        }
+    }
+
+    // Send every queued packet at once. Return -1 on failure.
+    if (!nwritev(conn, iov, iovcnt)) {
+        return -1;
+    }
+
+    // Lay out the responses the same way: a header each, followed by a block
+    // for the commands that return one, straight into the buffer given at submit time
+    iovcnt = 0;
+    for (int i = 0; i < count; i++) {
+        iov[iovcnt++] = (struct iovec){ conn->reply_headers[i], HEADER_LEN };
+        if (reply_has_block(conn->pending_ops[i])) {
+            uint8_t *block = conn->pending_blocks[i] ? conn->pending_blocks[i] : conn->discard_block;
+            iov[iovcnt++] = (struct iovec){ block, JBOD_BLOCK_SIZE };
+        }
+    }
+    if (!nreadv(conn, iov, iovcnt)) {
+        return -1;
+    }
+    stats_hist_record(&round_trips, started);
+
+    // Check every response. A length we did not lay out for means the stream is
+    // out of step with the requests, which cannot be recovered from.
+    int rc = 0;
+    for (int i = 0; i < count; i++) {
+        uint16_t len, ret;
+        uint32_t temp_op;
+        unpack_header(conn->reply_headers[i], &len, &temp_op, &ret);
+        if (len != HEADER_LEN + (reply_has_block(conn->pending_ops[i]) ? JBOD_BLOCK_SIZE : 0)) {
+            return -1;
+        }
+        if (ret != 0) {
+            rc = -1;
+            num_failed++;
+        }
+    }
+    return rc;
+}
+
+/* returns the |i|th oldest asynchronous operation */
+static async_op_t *async_op(jbod_conn_t *conn, int i) {
+    return &conn->async_ops[(conn->async_head + i) % conn->async_cap];
+}
+
+/* returns the length of the request packet of |aop| */
+static size_t request_len(const async_op_t *aop) {
+    return HEADER_LEN + (OP_CMD(aop->op) == JBOD_WRITE_BLOCK && aop->block != NULL ? JBOD_BLOCK_SIZE : 0);
+}
+
+/* returns the length of the reply packet of |aop| */
+static size_t reply_len(const async_op_t *aop) {
+    return HEADER_LEN + (reply_has_block(aop->op) ? JBOD_BLOCK_SIZE : 0);
+}
+
+int jbod_conn_submit_async(jbod_conn_t *conn, uint32_t op, uint8_t *block, jbod_done_fn done, void *tag) {
+    if (!conn_is_open(conn)) {
+        return -1;
+    }
+
+    // Grow the ring when it is full, unwrapping it so the oldest operation is first again
+    if (conn->async_count == conn->async_cap) {
+        int cap = conn->async_cap ? 2 * conn->async_cap : 256;
+        async_op_t *ops = malloc(cap * sizeof(async_op_t));
+        if (ops == NULL) {
+            return -1;
+        }
+        for (int i = 0; i < conn->async_count; i++) {
+            ops[i] = *async_op(conn, i);
+        }
+        free(conn->async_ops);
+        conn->async_ops = ops;
+        conn->async_cap = cap;
+        conn->async_head = 0;
+    }
+
+    async_op_t *aop = &conn->async_ops[(conn->async_head + conn->async_count) % conn->async_cap];
+    aop->op = op;
+    aop->block = block;
+    aop->done = done;
+    aop->tag = tag;
+    aop->submitted_ns = stats_now_ns();
+    cmd_counts[OP_CMD(op)]++;
+    pack_header(aop->request_header, op, request_len(aop) > HEADER_LEN);
+    conn->async_count++;
+    return 0;
+}
+
+int jbod_conn_in_flight(jbod_conn_t *conn) {
+    return conn->async_count;
+}
+
+/* jbod_conn_send_async over shared memory: copies as many unsent operations
+as there are free slots into the request ring */
+static int send_async_shm(jbod_conn_t *conn) {
+    shm_ring_t *ring = &conn->shm->requests;
+    uint32_t n = shm_ring_space(ring);
+    if (n > (uint32_t) (conn->async_count - conn->async_sent)) {
+        n = conn->async_count - conn->async_sent;
+    }
+    if (n == 0) {
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < n; i++) {
+        async_op_t *aop = async_op(conn, conn->async_sent + i);
+        shm_slot_t *slot = shm_ring_free_slot(ring, i);
+        slot->op = aop->op;
+        if (request_len(aop) > HEADER_LEN) {
+            memcpy(slot->block, aop->block, JBOD_BLOCK_SIZE);
+        }
+        bytes_sent += request_len(aop);
+    }
+    conn->num_syscalls += shm_ring_publish(ring, n);
+    conn->async_sent += n;
+    return 0;
+}
+
+int jbod_conn_send_async(jbod_conn_t *conn) {
+    if (conn->shm != NULL) {
+        return send_async_shm(conn);
+    }
+    while (conn->async_sent < conn->async_count) {
+        // Lay out as many unsent packets as fit, less what already went of the first
+        struct iovec iov[2 * ASYNC_BATCH];
+        int iovcnt = 0;
+        for (int i = conn->async_sent; i < conn->async_count && iovcnt + 2 <= 2 * ASYNC_BATCH; i++) {
+            async_op_t *aop = async_op(conn, i);
+            iov[iovcnt++] = (struct iovec){ aop->request_header, HEADER_LEN };
+            if (request_len(aop) > HEADER_LEN) {
+                iov[iovcnt++] = (struct iovec){ aop->block, JBOD_BLOCK_SIZE };
+            }
+        }
+        struct iovec *rest = iov;
+        iov_advance(&rest, &iovcnt, conn->send_off);
+
+        struct msghdr msg = { .msg_iov = rest, .msg_iovlen = iovcnt };
+        ssize_t n = sendmsg(conn->sd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        conn->num_syscalls++;
+        if (n < 0) {
+            return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+        }
+        bytes_sent += n;
+
+        // Count off the packets that are now out in full
+        size_t sent = conn->send_off + n;
+        while (conn->async_sent < conn->async_count && sent >= request_len(async_op(conn, conn->async_sent))) {
+            sent -= request_len(async_op(conn, conn->async_sent));
+            conn->async_sent++;
+        }
+        conn->send_off = sent;
+    }
+    return 0;
+}
+
+/* fails every asynchronous operation, once the connection is unusable */
+static void fail_async(jbod_conn_t *conn) {
+    conn->dispatching = true;
+    while (conn->async_count > 0) {
+        async_op_t aop = *async_op(conn, 0);
+        conn->async_head = (conn->async_head + 1) % conn->async_cap;
+        conn->async_count--;
+        if (aop.done) {
+            aop.done(aop.tag, -1);
+        }
+    }
+    conn->async_sent = 0;
+    conn->send_off = 0;
+    conn->recv_off = 0;
+    conn->dispatching = false;
+}
+
+/* an asynchronous operation taken off the ring, waiting for its callback */
+typedef struct {
+    jbod_done_fn done;
+    void *tag;
+    int rc;
+} finished_op_t;
+
+/* counts the oldest asynchronous operation, which has its reply, as done with
+result |ret| and takes it off the ring into |finished| */
+static void take_async(jbod_conn_t *conn, finished_op_t *finished, int ret) {
+    async_op_t *aop = async_op(conn, 0);
+    finished->done = aop->done;
+    finished->tag = aop->tag;
+    finished->rc = (ret == 0) ? 0 : -1;
+    num_failed += (ret != 0);
+    stats_hist_record(&round_trips, aop->submitted_ns);
+    conn->async_head = (conn->async_head + 1) % conn->async_cap;
+    conn->async_count--;
+    conn->async_sent--;
+}
+
+/* runs the callbacks of the |num_finished| operations at |finished| */
+static void run_callbacks(jbod_conn_t *conn, const finished_op_t *finished, int num_finished) {
+    conn->num_ops += num_finished;
+    conn->dispatching = true;
+    for (int i = 0; i < num_finished; i++) {
+        if (finished[i].done) {
+            finished[i].done(finished[i].tag, finished[i].rc);
+        }
+    }
+    conn->dispatching = false;
+}
+
+/* receive_async over shared memory: takes the replies waiting in the reply
+ring, copying out their blocks, and runs their callbacks */
+static int receive_async_shm(jbod_conn_t *conn) {
+    shm_ring_t *ring = &conn->shm->replies;
+    uint32_t n = shm_ring_ready(ring);
+    if (n > (uint32_t) conn->async_sent) {
+        n = conn->async_sent;
+    }
+    if (n > ASYNC_BATCH) {
+        n = ASYNC_BATCH;
+    }
+
+    // A reply for another operation means the rings are out of step with the
+    // requests, which cannot be recovered from
+    for (uint32_t i = 0; i < n; i++) {
+        if (shm_ring_ready_slot(ring, i)->op != async_op(conn, i)->op) {
+            fail_async(conn);
+            return -1;
+        }
+    }
+
+    finished_op_t finished[ASYNC_BATCH];
+    for (uint32_t i = 0; i < n; i++) {
+        shm_slot_t *slot = shm_ring_ready_slot(ring, i);
+        async_op_t *aop = async_op(conn, 0);
+        if (reply_has_block(aop->op) && aop->block != NULL) {
+            memcpy(aop->block, slot->block, JBOD_BLOCK_SIZE);
+        }
+        bytes_received += reply_len(aop);
+        take_async(conn, &finished[i], slot->ret);
+    }
+    conn->num_syscalls += shm_ring_release(ring, n);
+
+    run_callbacks(conn, finished, n);
+    return n;
 }
 
-// Prepare variables temp_op and ret to receive the response
-uint32_t temp_op;
-uint16_t ret;
+/* takes in whatever replies have arrived and runs their callbacks; returns the
+number of operations completed, or -1 if the connection failed. */
+static int receive_async(jbod_conn_t *conn) {
+    // Lay out the replies of the operations that went out, less what already came of the first
+    struct iovec iov[2 * ASYNC_BATCH];
+    int iovcnt = 0;
+    for (int i = 0; i < conn->async_sent && i < ASYNC_BATCH; i++) {
+        async_op_t *aop = async_op(conn, i);
+        iov[iovcnt++] = (struct iovec){ aop->reply_header, HEADER_LEN };
+        if (reply_has_block(aop->op)) {
+            iov[iovcnt++] = (struct iovec){ aop->block ? aop->block : conn->discard_block, JBOD_BLOCK_SIZE };
+        }
+    }
+    if (iovcnt == 0) {
+        return 0;
+    }
+    struct iovec *rest = iov;
+    iov_advance(&rest, &iovcnt, conn->recv_off);
+
+    size_t room = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        room += rest[i].iov_len;
+    }
+
+    struct msghdr msg = { .msg_iov = rest, .msg_iovlen = iovcnt };
+    ssize_t n = recvmsg(conn->sd, &msg, MSG_DONTWAIT);
+    conn->num_syscalls++;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return 0;
+    }
+    if (n <= 0) {
+        fail_async(conn);
+        return -1;
+    }
+    bytes_received += n;
+
+    // Take the replies that are now in full off the ring before running any
+    // callback, since a callback may queue more operations
+    finished_op_t finished[ASYNC_BATCH];
+    int num_finished = 0;
+    size_t got = conn->recv_off + n;
+    while (conn->async_sent > 0 && got >= reply_len(async_op(conn, 0))) {
+        async_op_t *aop = async_op(conn, 0);
+        uint16_t len, ret;
+        uint32_t temp_op;
+        got -= reply_len(aop);
+        unpack_header(aop->reply_header, &len, &temp_op, &ret);
+        if (len != reply_len(aop)) {
+            fail_async(conn); // out of step with the requests, which cannot be recovered from
+            return -1;
+        }
+        take_async(conn, &finished[num_finished++], ret);
+    }
+    conn->recv_off = got;
+
+    // A short read emptied the socket, so the caller waits for what is left
+    if ((size_t) n < room && conn->async_sent > 0) {
+        rearm_quickack(conn);
+    }
 
-// Receive a response packet from the server. Return -1 on failure.
-if (!recv_packet(cli_sd, &temp_op, &ret, block)) {
-    return -1;
+    run_callbacks(conn, finished, num_finished);
+    return num_finished;
 }
 
-// Return the status code from the server response as an integer.
-return (int)ret;
-}
\ No newline at end of file
+int jbod_conn_poll(jbod_conn_t *conn, int timeout_ms) {
+    if (conn->async_count == 0) {
+        return 0;
+    }
+    if (jbod_conn_send_async(conn) == -1) {
+        fail_async(conn);
+        return -1;
+    }
+
+    // Shared memory has no descriptor to wait on, so wait on the reply ring itself
+    if (conn->shm != NULL) {
+        int rc = shm_ring_wait_ready(&conn->shm->replies, timeout_ms, conn->shm->server_pid, &conn->num_syscalls);
+        if (rc == -1) {
+            fail_async(conn);
+            return -1;
+        }
+        return rc == 0 ? 0 : receive_async_shm(conn);
+    }
+
+    // Wait for replies, and for room to send while anything is left unsent
+    if (conn->epfd == -1) {
+        conn->epfd = epoll_create1(0);
+        conn->ep_events = 0;
+        if (conn->epfd == -1) {
+            fail_async(conn);
+            return -1;
+        }
+    }
+    uint32_t want = EPOLLIN | (conn->async_sent < conn->async_count ? EPOLLOUT : 0);
+    if (want != conn->ep_events) {
+        struct epoll_event ev = { .events = want, .data.fd = conn->sd };
+        int rc = epoll_ctl(conn->epfd, conn->ep_events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, conn->sd, &ev);
+        conn->num_syscalls++;
+        if (rc == -1) {
+            fail_async(conn);
+            return -1;
+        }
+        conn->ep_events = want;
+    }
+
+    struct epoll_event ev;
+    int ready = epoll_wait(conn->epfd, &ev, 1, timeout_ms);
+    conn->num_syscalls++;
+    if (ready == 0 || (ready < 0 && errno == EINTR)) {
+        return 0;
+    }
+    if (ready < 0) {
+        fail_async(conn);
+        return -1;
+    }
+    if ((ev.events & EPOLLOUT) && jbod_conn_send_async(conn) == -1) {
+        fail_async(conn);
+        return -1;
+    }
+    if (ev.events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+        return receive_async(conn);
+    }
+    return 0;
+}
+
+int jbod_conn_drain(jbod_conn_t *conn) {
+    while (conn->async_count > 0) {
+        if (jbod_conn_poll(conn, -1) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int jbod_client_submit(uint32_t op, uint8_t *block) {
+    return jbod_conn_submit(&cli_conn, op, block);
+}
+
+int jbod_client_complete(void) {
+    return jbod_conn_complete(&cli_conn);
+}
+
+/* prints the average number of socket system calls per JBOD operation, over
+every connection */
+void jbod_print_syscalls_per_op(void) {
+    unsigned long num_syscalls = cli_conn.num_syscalls + closed_syscalls;
+    unsigned long num_ops = cli_conn.num_ops + closed_ops;
+    for (int i = 0; i < pool_size; i++) {
+        num_syscalls += pool_conns[i].num_syscalls;
+        num_ops += pool_conns[i].num_ops;
+    }
+    fprintf(stderr, "Syscalls per op: %5.2f\n", num_ops ? (float) num_syscalls / num_ops : 0.0f);
+}
+
+void jbod_get_stats(jbod_stats_t *stats) {
+    for (int i = 0; i < JBOD_NUM_CMDS; i++) {
+        stats->commands[i] = cmd_counts[i];
+    }
+    stats->failed = num_failed;
+    stats->bytes_sent = bytes_sent;
+    stats->bytes_received = bytes_received;
+    stats_hist_copy(&stats->round_trip, &round_trips);
+}
+
+/* sends the JBOD operation to the server and waits for its response, after
+those of anything queued before it.
+
+The meaning of each parameter is the same as in the original jbod_operation function.
+return: 0 means success, -1 means failure.
+*/
+int jbod_client_operation(uint32_t op, uint8_t *block) {
+    if (jbod_client_submit(op, block) == -1) {
+        return -1;
+    }
+    return jbod_client_complete();
+}
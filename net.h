@@ -4,12 +4,122 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#include "jbod.h"
+#include "stats.h"
+
 #define HEADER_LEN (sizeof(uint16_t) + sizeof(uint32_t) + sizeof(uint16_t))
 #define JBOD_SERVER "127.0.0.1"
 #define JBOD_PORT 3333
 
+/* What starts the ip given to jbod_connect to talk to shm_server on this
+ * machine through shared memory instead, followed by the name it serves at
+ * (see shm.h); the port is then ignored. */
+#define JBOD_SHM_PREFIX "shm:"
+
+/* Most requests jbod_client_submit queues before it has to send them */
+#define JBOD_PIPELINE_DEPTH 64
+
+/* Most connections jbod_connect_pool opens */
+#define JBOD_MAX_POOL_CONNS 16
+
+/* A connection to the server, with its own request pipeline */
+typedef struct jbod_conn jbod_conn_t;
+
 int jbod_client_operation(uint32_t op, uint8_t *block);
+
+/* Queues a JBOD operation without waiting for its reply; returns 0 on success
+ * and -1 on failure. |block| is neither copied nor sent yet, so it must stay
+ * valid until jbod_client_complete. A full queue is completed first, and that
+ * completion's result is returned. */
+int jbod_client_submit(uint32_t op, uint8_t *block);
+
+/* Sends every queued operation at once and collects the replies in order;
+ * returns 0 if all of them succeeded and -1 otherwise. */
+int jbod_client_complete(void);
+
+/* Connects to the server at |ip| and |port|, over TCP or, for an ip starting
+ * with JBOD_SHM_PREFIX, shared memory; returns true on success. Every call
+ * below works the same over either. shm_server takes one connection at a
+ * time, so neither jbod_connect_pool nor jbod_conn_open can add more to it. */
 bool jbod_connect(const char *ip, uint16_t port);
 void jbod_disconnect(void);
 
+/* Opens |num_conns| more connections to the server, next to the one from
+ * jbod_connect, so mdadm can work on several disks at once; returns true on
+ * success. The server has to accept concurrent clients and keep a separate
+ * head position for each. Each connection has to answer a handshake within
+ * two seconds, so a server that serves one client at a time fails this
+ * rather than leaving requests hanging. jbod_disconnect closes them too. */
+bool jbod_connect_pool(const char *ip, uint16_t port, int num_conns);
+
+/* Returns how many pooled connections are open, and the |i|th of them. */
+int jbod_pool_size(void);
+jbod_conn_t *jbod_pool_conn(int i);
+
+/* Returns the connection opened by jbod_connect. */
+jbod_conn_t *jbod_client_conn(void);
+
+/* Opens one more connection to the server jbod_connect connected to, for a
+ * thread of its own; returns NULL on failure, which includes a server that
+ * does not answer the handshake jbod_connect_pool makes. jbod_conn_close
+ * closes it again and must be called before jbod_disconnect. */
+jbod_conn_t *jbod_conn_open(void);
+void jbod_conn_close(jbod_conn_t *conn);
+
+/* jbod_client_submit and jbod_client_complete for a given connection. A
+ * connection must only be used by one thread at a time. */
+int jbod_conn_submit(jbod_conn_t *conn, uint32_t op, uint8_t *block);
+int jbod_conn_complete(jbod_conn_t *conn);
+
+/* Called with the |tag| given to jbod_conn_submit_async once the operation
+ * has its reply; |rc| is 0 on success and -1 on failure. */
+typedef void (*jbod_done_fn)(void *tag, int rc);
+
+/* Queues a JBOD operation on the connection's event loop, without sending it;
+ * returns 0 on success and -1 on failure. As with jbod_conn_submit, |block|
+ * must stay valid until |done| is called. Asynchronous operations go out and
+ * complete in the order they were queued, ahead of any jbod_conn_submit after
+ * them. */
+int jbod_conn_submit_async(jbod_conn_t *conn, uint32_t op, uint8_t *block, jbod_done_fn done, void *tag);
+
+/* Sends as much of what is queued as the socket takes without blocking;
+ * returns 0 on success and -1 on failure. */
+int jbod_conn_send_async(jbod_conn_t *conn);
+
+/* Runs one pass of the event loop: sends what it can, waits up to
+ * |timeout_ms| (-1 for no limit) with epoll for replies, and calls back for
+ * the operations they complete. Returns the number completed, or -1 if the
+ * connection failed, in which case every queued operation is called back with
+ * -1. Callbacks may queue more operations, but must not call
+ * jbod_conn_complete on the same connection. */
+int jbod_conn_poll(jbod_conn_t *conn, int timeout_ms);
+
+/* Returns the number of asynchronous operations not yet called back. */
+int jbod_conn_in_flight(jbod_conn_t *conn);
+
+/* Polls until every asynchronous operation is called back; returns 0 on
+ * success and -1 if the connection failed. */
+int jbod_conn_drain(jbod_conn_t *conn);
+
+/* Prints the average number of socket, or for shared memory futex, system
+ * calls per JBOD operation. */
+void jbod_print_syscalls_per_op(void);
+
+/* What the connections have done since the program started */
+typedef struct {
+  uint64_t commands[JBOD_NUM_CMDS]; /* operations sent, by command */
+  uint64_t failed;                  /* operations the server answered with an error */
+  uint64_t bytes_sent;              /* bytes written to the sockets, or packets' worth
+                                       put in the shared-memory rings, headers included */
+  uint64_t bytes_received;          /* bytes read from the sockets, or taken from the
+                                       rings, headers included */
+  stats_hist_t round_trip;          /* from sending a batch of jbod_conn_complete to
+                                       its last reply, and from queueing an
+                                       asynchronous operation to its reply */
+} jbod_stats_t;
+
+/* Fills in |stats| with the totals over every connection. Safe to call while
+ * other threads are using their connections. */
+void jbod_get_stats(jbod_stats_t *stats);
+
 #endif
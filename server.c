@@ -0,0 +1,466 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <err.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "jbod.h"
+#include "tester.h"
+#include "server.h"
+
+#define SERVER_ARGUMENTS "hp:i:v"
+#define USAGE                                                               \
+  "USAGE: server [-h] [-p port] [-i image-file] [-v]\n"                    \
+  "\n"                                                                      \
+  "Serves the JBOD of jbod.o to any number of clients at once, over the\n" \
+  "protocol net.c speaks, each client with a head position of its own.\n" \
+  "\n"                                                                      \
+  "where:\n"                                                                \
+  "    -h - help mode (display this message)\n"                             \
+  "    -p - listen on this port (default 3333)\n"                           \
+  "    -i - keep the disks in this file, mapped into memory: loaded at\n"  \
+  "         every MOUNT, which otherwise zeroes them, and updated by\n"    \
+  "         every write, so they outlive the server\n"                     \
+  "    -v - print what was served, and its cost, on exit\n"               \
+  "\n"                                                                      \
+
+/* the fields of a JBOD opcode (see use_addr in mdadm.c) */
+#define OP_CMD(op) (((op) >> 14) & 0x3f)
+#define OP_DISK(op) (((op) >> 28) & 0xf)
+#define OP_BLOCK(op) (((op) >> 20) & 0xff)
+
+/* the epoll tag of the listening socket; a client's is its slot */
+#define LISTENER SERVER_MAX_CLIENTS
+
+static server_client_t *clients[SERVER_MAX_CLIENTS];
+static int num_slots = 0;          /* slots ever used, the ones a round visits */
+static int epfd;
+
+/* where jbod.o's head is, -1 when not known */
+static int head_disk = -1, head_block = -1;
+
+/* the disk image of -i, or NULL */
+static uint8_t *image;
+
+static unsigned long num_served = 0, num_clients = 0, num_reseeks = 0;
+static volatile sig_atomic_t stopping = 0;
+
+static void stop(int sig)
+{
+  (void) sig;
+  stopping = 1;
+}
+
+static uint32_t encode_op(jbod_cmd_t cmd, int disk_num, int block_num)
+{
+  return (uint32_t) cmd << 14 | (uint32_t) disk_num << 28 | (uint32_t) block_num << 20;
+}
+
+/* Maps the disk image at |path|, creating it zeroed if it is new. */
+static uint8_t *open_image(const char *path)
+{
+  struct stat st;
+  int fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (fd == -1)
+    return NULL;
+  if (fstat(fd, &st) == -1 || (st.st_size == 0 && ftruncate(fd, SERVER_IMAGE_SIZE) == -1) ||
+      (st.st_size != 0 && st.st_size != SERVER_IMAGE_SIZE)) {
+    close(fd);
+    return NULL;
+  }
+  uint8_t *map = mmap(NULL, SERVER_IMAGE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  return map == MAP_FAILED ? NULL : map;
+}
+
+/* Writes the blocks of the image that are not zeros to the disks, which MOUNT
+ * has just zeroed. Returns 0 on success and -1 on failure. */
+static int load_image(void)
+{
+  static const uint8_t zeros[JBOD_BLOCK_SIZE];
+
+  for (int d = 0; d < JBOD_NUM_DISKS; ++d)
+    for (int b = 0; b < JBOD_NUM_BLOCKS_PER_DISK; ++b) {
+      uint8_t *block = image + d * JBOD_DISK_SIZE + b * JBOD_BLOCK_SIZE;
+      if (memcmp(block, zeros, JBOD_BLOCK_SIZE) == 0)
+        continue;
+      head_disk = head_block = -1;
+      if (jbod_operation(encode_op(JBOD_SEEK_TO_DISK, d, 0), NULL) == -1 ||
+          jbod_operation(encode_op(JBOD_SEEK_TO_BLOCK, 0, b), NULL) == -1 ||
+          jbod_operation(encode_op(JBOD_WRITE_BLOCK, 0, 0), block) == -1)
+        return -1;
+      head_disk = d;
+      head_block = b + 1;
+    }
+  return 0;
+}
+
+/* Seeks jbod.o's head to |c|'s, if another client has moved it. A client that
+ * has not sought yet takes the head where it is. Returns 0 on success and -1
+ * on failure. */
+static int seek_head(server_client_t *c)
+{
+  if (c->disk == -1) {
+    c->disk = head_disk;
+    c->block = head_block;
+  }
+  if (c->disk == -1 || (c->disk == head_disk && c->block == head_block))
+    return 0;
+
+  ++num_reseeks;
+  head_disk = head_block = -1;
+  if (jbod_operation(encode_op(JBOD_SEEK_TO_DISK, c->disk, 0), NULL) == -1 ||
+      jbod_operation(encode_op(JBOD_SEEK_TO_BLOCK, 0, c->block), NULL) == -1)
+    return -1;
+  head_disk = c->disk;
+  head_block = c->block;
+  return 0;
+}
+
+/* Does |op| for client |c| with jbod_operation, keeping track of the heads.
+ * |block| is the request's block for a write and the reply's for a read or a
+ * signature, and NULL otherwise. Returns what jbod_operation does. */
+static int execute(server_client_t *c, uint32_t op, uint8_t *block)
+{
+  int rc;
+
+  switch (OP_CMD(op)) {
+    case JBOD_MOUNT:
+      rc = jbod_operation(op, NULL);
+      if (rc == 0) {
+        /* MOUNT zeroes the disks and puts the head at the start */
+        head_disk = head_block = 0;
+        if (image)
+          rc = load_image();
+      }
+      return rc;
+    case JBOD_UNMOUNT:
+      if (image)
+        msync(image, SERVER_IMAGE_SIZE, MS_ASYNC);
+      return jbod_operation(op, NULL);
+    case JBOD_SEEK_TO_DISK:
+      rc = jbod_operation(op, NULL);
+      if (rc == 0) {
+        c->disk = head_disk = OP_DISK(op);
+        c->block = head_block = 0;
+      }
+      return rc;
+    case JBOD_SEEK_TO_BLOCK:
+      /* jbod.o seeks within the disk its head is on, which has to be this client's */
+      if (seek_head(c) == -1)
+        return -1;
+      rc = jbod_operation(op, NULL);
+      if (rc == 0 && c->disk != -1)
+        c->block = head_block = OP_BLOCK(op);
+      return rc;
+    case JBOD_READ_BLOCK:
+    case JBOD_WRITE_BLOCK:
+      /* a write needs its block, and a head past the end of a disk cannot be sought back to */
+      if (block == NULL || (c->disk != -1 && c->block >= JBOD_NUM_BLOCKS_PER_DISK) || seek_head(c) == -1)
+        return -1;
+      rc = jbod_operation(op, block);
+      if (rc == -1) {
+        head_disk = head_block = -1;
+        return -1;
+      }
+      if (c->disk != -1) {
+        if (image && OP_CMD(op) == JBOD_WRITE_BLOCK)
+          memcpy(image + c->disk * JBOD_DISK_SIZE + c->block * JBOD_BLOCK_SIZE, block, JBOD_BLOCK_SIZE);
+        c->block = ++head_block;
+      }
+      return 0;
+    default:
+      /* a signature leaves the head where it is */
+      return jbod_operation(op, block);
+  }
+}
+
+/* Returns true if |c| has a whole request read at |off|, and room for its reply. */
+static bool can_serve(const server_client_t *c, size_t off)
+{
+  uint16_t len;
+  if (c->in_len - off < HEADER_LEN || c->out_len - c->out_off >= SERVER_OUT_LIMIT)
+    return false;
+  memcpy(&len, c->in + off, sizeof(len));
+  return c->in_len - off >= ntohs(len);
+}
+
+/* Makes room for a reply at the end of |c|'s queue; returns false on failure. */
+static bool reserve_reply(server_client_t *c)
+{
+  if (c->out_off > 0 && c->out_len + SERVER_MAX_PACKET > c->out_cap) {
+    memmove(c->out, c->out + c->out_off, c->out_len - c->out_off);
+    c->out_len -= c->out_off;
+    c->out_off = 0;
+  }
+  if (c->out_len + SERVER_MAX_PACKET > c->out_cap) {
+    size_t cap = c->out_cap ? 2 * c->out_cap : 16 * SERVER_MAX_PACKET;
+    uint8_t *out = realloc(c->out, cap);
+    if (!out)
+      return false;
+    c->out = out;
+    c->out_cap = cap;
+  }
+  return true;
+}
+
+/* Serves up to SERVER_QUANTUM of |c|'s requests, queueing their replies.
+ * Returns the number served, or -1 if |c| broke the protocol. */
+static int serve_requests(server_client_t *c)
+{
+  size_t off = 0;
+  int served = 0;
+
+  while (served < SERVER_QUANTUM && can_serve(c, off)) {
+    uint8_t *request = c->in + off;
+    uint16_t len;
+    uint32_t op;
+    memcpy(&len, request, sizeof(len));
+    memcpy(&op, request + 2, sizeof(op));
+    len = ntohs(len);
+    op = ntohl(op);
+    if (len != HEADER_LEN && len != SERVER_MAX_PACKET)
+      return -1;
+    if (!reserve_reply(c))
+      return -1;
+
+    /* a read or a signature goes straight into the reply, which carries a
+       block even when it fails */
+    uint8_t *reply = c->out + c->out_len;
+    bool has_block = (OP_CMD(op) == JBOD_READ_BLOCK || OP_CMD(op) == JBOD_SIGN_BLOCK);
+    uint8_t *block = has_block ? reply + HEADER_LEN : (len > HEADER_LEN ? request + HEADER_LEN : NULL);
+    if (has_block)
+      memset(block, 0, JBOD_BLOCK_SIZE);
+    int rc = execute(c, op, block);
+
+    uint16_t reply_len = htons(HEADER_LEN + (has_block ? JBOD_BLOCK_SIZE : 0));
+    uint32_t reply_op = htonl(op);
+    uint16_t ret = htons(rc == 0 ? 0 : (uint16_t) -1);
+    memcpy(reply, &reply_len, sizeof(reply_len));
+    memcpy(reply + 2, &reply_op, sizeof(reply_op));
+    memcpy(reply + 6, &ret, sizeof(ret));
+    c->out_len += ntohs(reply_len);
+
+    off += len;
+    ++served;
+  }
+  memmove(c->in, c->in + off, c->in_len - off);
+  c->in_len -= off;
+  c->num_ops += served;
+  num_served += served;
+  return served;
+}
+
+/* Reads what |c| has sent, as far as its buffer takes; returns false once it
+ * has closed the connection or it failed. */
+static bool read_requests(server_client_t *c)
+{
+  while (c->in_len < SERVER_IN_BUF) {
+    ssize_t n = read(c->fd, c->in + c->in_len, SERVER_IN_BUF - c->in_len);
+    if (n < 0)
+      return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    if (n == 0)
+      return false;
+    c->in_len += n;
+  }
+  return true;
+}
+
+/* Sends |c| what it takes of its replies; returns false if that failed. */
+static bool send_replies(server_client_t *c)
+{
+  while (c->out_off < c->out_len) {
+    ssize_t n = send(c->fd, c->out + c->out_off, c->out_len - c->out_off, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n < 0)
+      return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    c->out_off += n;
+  }
+  c->out_off = c->out_len = 0;
+  return true;
+}
+
+/* Has epoll wait for what |c| can take: more requests while there is room
+ * for them and for their replies, and a chance to send while replies are
+ * queued. Returns false if that failed. */
+static bool update_events(server_client_t *c, int slot)
+{
+  uint32_t want = 0;
+  if (c->in_len < SERVER_IN_BUF && c->out_len - c->out_off < SERVER_OUT_LIMIT)
+    want |= EPOLLIN;
+  if (c->out_off < c->out_len)
+    want |= EPOLLOUT;
+  if (want == c->events)
+    return true;
+
+  struct epoll_event ev = { .events = want, .data.u32 = slot };
+  if (epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev) == -1)
+    return false;
+  c->events = want;
+  return true;
+}
+
+static void drop_client(int slot)
+{
+  close(clients[slot]->fd);
+  free(clients[slot]->out);
+  free(clients[slot]);
+  clients[slot] = NULL;
+}
+
+/* Takes every connection waiting on |listener|. */
+static void accept_clients(int listener)
+{
+  for (;;) {
+    int fd = accept(listener, NULL, NULL);
+    if (fd == -1)
+      return;
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+
+    int slot = 0;
+    while (slot < SERVER_MAX_CLIENTS && clients[slot])
+      ++slot;
+    server_client_t *c = slot < SERVER_MAX_CLIENTS ? calloc(1, sizeof(*c)) : NULL;
+    if (!c) {
+      close(fd);
+      continue;
+    }
+    /* replies go out as soon as they are ready, however small */
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    c->fd = fd;
+    c->disk = c->block = -1;
+    c->events = EPOLLIN;
+    struct epoll_event ev = { .events = EPOLLIN, .data.u32 = slot };
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+      close(fd);
+      free(c);
+      continue;
+    }
+    clients[slot] = c;
+    if (slot >= num_slots)
+      num_slots = slot + 1;
+    ++num_clients;
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  int ch, port = JBOD_PORT;
+  bool verbose = false;
+  char *image_file = NULL;
+
+  while ((ch = getopt(argc, argv, SERVER_ARGUMENTS)) != -1) {
+    switch (ch) {
+      case 'h':
+        fprintf(stderr, USAGE);
+        return 0;
+      case 'p':
+        port = atoi(optarg);
+        break;
+      case 'i':
+        image_file = optarg;
+        break;
+      case 'v':
+        verbose = true;
+        break;
+      default:
+        fprintf(stderr, "Unknown command line option (%c), aborting.\n", ch);
+        return -1;
+    }
+  }
+
+  if (image_file && !(image = open_image(image_file)))
+    err(1, "Cannot map disk image %s", image_file);
+
+  struct sigaction sa = { .sa_handler = stop };
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  int listener = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (listener == -1)
+    err(1, "Cannot create socket");
+  int one = 1;
+  setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = htonl(INADDR_ANY) };
+  if (bind(listener, (struct sockaddr *) &addr, sizeof(addr)) == -1 || listen(listener, SOMAXCONN) == -1)
+    err(1, "Cannot listen on port %d", port);
+
+  if ((epfd = epoll_create1(0)) == -1)
+    err(1, "Cannot create epoll instance");
+  struct epoll_event lev = { .events = EPOLLIN, .data.u32 = LISTENER };
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, listener, &lev) == -1)
+    err(1, "Cannot watch the listening socket");
+
+  /* Each pass takes in what has arrived, then gives every client with a
+     whole request a turn of up to SERVER_QUANTUM of them, starting one client
+     further along each pass. Clients left with requests make the next pass
+     come straight away. */
+  int first = 0;
+  bool backlog = false;
+  while (!stopping) {
+    struct epoll_event evs[64];
+    int n = epoll_wait(epfd, evs, 64, backlog ? 0 : -1);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      err(1, "epoll_wait failed");
+    }
+
+    for (int i = 0; i < n; ++i) {
+      int slot = evs[i].data.u32;
+      if (slot == LISTENER) {
+        accept_clients(listener);
+        continue;
+      }
+      server_client_t *c = clients[slot];
+      if (!c)
+        continue;
+      if (((evs[i].events & EPOLLOUT) && !send_replies(c)) ||
+          ((evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && !read_requests(c)))
+        drop_client(slot);
+    }
+
+    backlog = false;
+    for (int k = 0; k < num_slots; ++k) {
+      int slot = (first + k) % num_slots;
+      server_client_t *c = clients[slot];
+      if (!c)
+        continue;
+      if (serve_requests(c) == -1 || !send_replies(c) || !update_events(c, slot)) {
+        drop_client(slot);
+        continue;
+      }
+      backlog = backlog || can_serve(c, 0);
+    }
+    first = num_slots ? (first + 1) % num_slots : 0;
+  }
+
+  for (int slot = 0; slot < num_slots; ++slot)
+    if (clients[slot])
+      drop_client(slot);
+  close(listener);
+  close(epfd);
+  if (image) {
+    msync(image, SERVER_IMAGE_SIZE, MS_SYNC);
+    munmap(image, SERVER_IMAGE_SIZE);
+  }
+  if (verbose) {
+    fprintf(stderr, "Served %lu operations to %lu clients, seeking back to a client's head %lu times.\n",
+            num_served, num_clients, num_reseeks);
+    jbod_print_cost();
+  }
+  return 0;
+}
@@ -0,0 +1,48 @@
+#ifndef SERVER_H_
+#define SERVER_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "jbod.h"
+#include "net.h"
+
+/* Most clients server takes at once */
+#define SERVER_MAX_CLIENTS 1024
+
+/* Most requests a client has served in one round before the next client's
+ * turn, so a deep pipeline cannot starve a shallow one */
+#define SERVER_QUANTUM 16
+
+/* Longest packet either way: a header and a block */
+#define SERVER_MAX_PACKET (HEADER_LEN + JBOD_BLOCK_SIZE)
+
+/* Requests read from a client but not yet served */
+#define SERVER_IN_BUF (64 * SERVER_MAX_PACKET)
+
+/* Replies not yet sent past which a client is served no more requests until
+ * it reads them */
+#define SERVER_OUT_LIMIT (256 * SERVER_MAX_PACKET)
+
+/* Size of the disk image -i keeps */
+#define SERVER_IMAGE_SIZE (JBOD_NUM_DISKS * JBOD_DISK_SIZE)
+
+/* A connected client. jbod.o has a single head, so each client has a head of
+ * its own, which the server seeks jbod.o's to before serving its reads and
+ * writes whenever another client has moved it. */
+typedef struct {
+  int fd;
+  uint8_t in[SERVER_IN_BUF];     /* requests read, from the start */
+  size_t in_len;
+  uint8_t *out;                  /* replies queued, of which out_off went */
+  size_t out_len;
+  size_t out_off;
+  size_t out_cap;
+  uint32_t events;               /* what epoll waits for on fd */
+  int disk;                      /* this client's head, -1 until it seeks */
+  int block;
+  unsigned long num_ops;
+} server_client_t;
+
+#endif
@@ -0,0 +1,229 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "shm.h"
+#include "stats.h"
+
+/* Times a waiter checks its ring before it goes to sleep: a reply usually
+ * comes sooner than a futex round trip through the scheduler would take.
+ * With one CPU the peer cannot run meanwhile, so there it sleeps at once. */
+#define SPIN_ROUNDS 4000
+
+/* Longest a waiter sleeps before it checks that its peer is still there */
+#define WAIT_SLICE_MS 100
+
+/* Returns the times to check a ring before sleeping on it. */
+static int spin_rounds(void) {
+  static int rounds = -1;
+  if (rounds == -1) {
+    rounds = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SPIN_ROUNDS : 0;
+  }
+  return rounds;
+}
+
+/* Returns true unless process |pid| is known to be gone. */
+static bool alive(pid_t pid) {
+  return kill(pid, 0) == 0 || errno != ESRCH;
+}
+
+/* Sleeps while |*word| is still |seen|, for up to |timeout_ms|. */
+static void futex_wait(uint32_t *word, uint32_t seen, int timeout_ms) {
+  struct timespec ts = { timeout_ms / 1000, (timeout_ms % 1000) * 1000000L };
+  syscall(SYS_futex, word, FUTEX_WAIT, seen, &ts, NULL, 0);
+}
+
+/* Wakes whoever sleeps on |*word|. */
+static void futex_wake(uint32_t *word) {
+  syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/* Moves |*word| on by |n| and wakes its waiter, if it raised |*waiting|;
+ * returns the number of system calls made. Both are sequentially consistent,
+ * so either the waiter sees the new value or this sees its flag. */
+static int advance(uint32_t *word, uint32_t *waiting, uint32_t n) {
+  __atomic_store_n(word, *word + n, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(waiting, __ATOMIC_SEQ_CST) && __atomic_exchange_n(waiting, 0, __ATOMIC_SEQ_CST)) {
+    futex_wake(word);
+    return 1;
+  }
+  return 0;
+}
+
+uint32_t shm_ring_space(shm_ring_t *ring) {
+  return SHM_RING_SLOTS - (ring->head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE));
+}
+
+shm_slot_t *shm_ring_free_slot(shm_ring_t *ring, uint32_t i) {
+  return &ring->slots[(ring->head + i) % SHM_RING_SLOTS];
+}
+
+int shm_ring_publish(shm_ring_t *ring, uint32_t n) {
+  return advance(&ring->head, &ring->head_waiting, n);
+}
+
+uint32_t shm_ring_ready(shm_ring_t *ring) {
+  return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - ring->tail;
+}
+
+shm_slot_t *shm_ring_ready_slot(shm_ring_t *ring, uint32_t i) {
+  return &ring->slots[(ring->tail + i) % SHM_RING_SLOTS];
+}
+
+int shm_ring_release(shm_ring_t *ring, uint32_t n) {
+  return advance(&ring->tail, &ring->tail_waiting, n);
+}
+
+/* Waits until |count| of |ring| is above 0, sleeping on |*word|, the index
+ * the other side moves, with |*waiting| raised. See shm_ring_wait_ready. */
+static int wait_for(shm_ring_t *ring, uint32_t (*count)(shm_ring_t *), uint32_t *word, uint32_t *waiting,
+                    int timeout_ms, pid_t peer, unsigned long *num_syscalls) {
+  for (int i = 0; i < spin_rounds(); i++) {
+    if (count(ring) > 0) {
+      return 1;
+    }
+  }
+
+  uint64_t deadline = stats_now_ns() + (uint64_t) timeout_ms * 1000000;
+  for (;;) {
+    // Raise the flag, then look again: anything that moved |*word| before the
+    // flag went up is seen here, and anything after wakes the futex
+    uint32_t seen = __atomic_load_n(word, __ATOMIC_SEQ_CST);
+    __atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+    if (count(ring) > 0) {
+      __atomic_store_n(waiting, 0, __ATOMIC_SEQ_CST);
+      return 1;
+    }
+
+    int slice = WAIT_SLICE_MS;
+    if (timeout_ms >= 0) {
+      uint64_t now = stats_now_ns();
+      if (now >= deadline) {
+        __atomic_store_n(waiting, 0, __ATOMIC_SEQ_CST);
+        return 0;
+      }
+      if ((deadline - now) / 1000000 < (uint64_t) slice) {
+        slice = (deadline - now) / 1000000 + 1;
+      }
+    }
+    futex_wait(word, seen, slice);
+    (*num_syscalls)++;
+    __atomic_store_n(waiting, 0, __ATOMIC_SEQ_CST);
+
+    if (count(ring) > 0) {
+      return 1;
+    }
+    if (peer != 0 && !alive(peer)) {
+      return -1;
+    }
+  }
+}
+
+int shm_ring_wait_ready(shm_ring_t *ring, int timeout_ms, pid_t peer, unsigned long *num_syscalls) {
+  return wait_for(ring, shm_ring_ready, &ring->head, &ring->head_waiting, timeout_ms, peer, num_syscalls);
+}
+
+int shm_ring_wait_space(shm_ring_t *ring, int timeout_ms, pid_t peer, unsigned long *num_syscalls) {
+  return wait_for(ring, shm_ring_space, &ring->tail, &ring->tail_waiting, timeout_ms, peer, num_syscalls);
+}
+
+shm_region_t *shm_create(const char *name) {
+  // A fresh file each time: a client still mapping an old one sees its server gone
+  shm_unlink(name);
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd == -1) {
+    return NULL;
+  }
+  if (ftruncate(fd, sizeof(shm_region_t)) == -1) {
+    close(fd);
+    shm_unlink(name);
+    return NULL;
+  }
+  shm_region_t *region = mmap(NULL, sizeof(shm_region_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (region == MAP_FAILED) {
+    shm_unlink(name);
+    return NULL;
+  }
+
+  // The file starts out zeroed, so only the header needs filling in, magic last
+  region->server_pid = getpid();
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(region->magic, SHM_MAGIC, sizeof(region->magic));
+  return region;
+}
+
+void shm_destroy(shm_region_t *region, const char *name) {
+  munmap(region, sizeof(shm_region_t));
+  shm_unlink(name);
+}
+
+/* Skips the replies to whatever a dead client left in the request ring, so
+ * the next request is answered in step; returns true once they are all in. */
+static bool skip_stale(shm_region_t *region) {
+  unsigned long num_syscalls = 0;
+  for (;;) {
+    shm_ring_release(&region->replies, shm_ring_ready(&region->replies));
+    // The server publishes a reply before it releases the request, so with
+    // no request left every reply is in
+    if (shm_ring_ready(&region->requests) == 0 && shm_ring_ready(&region->replies) == 0) {
+      return true;
+    }
+    if (shm_ring_wait_ready(&region->replies, WAIT_SLICE_MS, region->server_pid, &num_syscalls) == -1) {
+      return false;
+    }
+  }
+}
+
+shm_region_t *shm_attach(const char *name) {
+  int fd = shm_open(name, O_RDWR, 0);
+  if (fd == -1) {
+    return NULL;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == -1 || st.st_size != sizeof(shm_region_t)) {
+    close(fd);
+    return NULL;
+  }
+  shm_region_t *region = mmap(NULL, sizeof(shm_region_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (region == MAP_FAILED) {
+    return NULL;
+  }
+  if (memcmp(region->magic, SHM_MAGIC, sizeof(region->magic)) != 0 || !alive(region->server_pid)) {
+    munmap(region, sizeof(shm_region_t));
+    return NULL;
+  }
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+  // Claim the region, or take it over from a client that died holding it
+  pid_t owner = 0;
+  while (!__atomic_compare_exchange_n(&region->client_pid, &owner, getpid(), false,
+                                      __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+    if (alive(owner)) {
+      munmap(region, sizeof(shm_region_t));
+      return NULL;
+    }
+  }
+  if (owner != 0 && !skip_stale(region)) {
+    shm_detach(region);
+    return NULL;
+  }
+  return region;
+}
+
+void shm_detach(shm_region_t *region) {
+  pid_t self = getpid();
+  __atomic_compare_exchange_n(&region->client_pid, &self, 0, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+  munmap(region, sizeof(shm_region_t));
+}
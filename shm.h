@@ -0,0 +1,93 @@
+#ifndef SHM_H_
+#define SHM_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "jbod.h"
+
+/* The shared-memory transport: a client and shm_server, on the same machine,
+ * exchange JBOD operations through two single-producer single-consumer rings
+ * in a POSIX shared-memory file. The client produces requests and consumes
+ * replies; the server does the opposite, answering every request in order. */
+
+/* Slots in each ring, a power of two no smaller than JBOD_PIPELINE_DEPTH */
+#define SHM_RING_SLOTS 256
+
+/* The name shm_server serves at when not told otherwise */
+#define SHM_DEFAULT_NAME "/jbod"
+
+/* What a region starts with once shm_server has set it up */
+#define SHM_MAGIC "JBODSHM1"
+
+/* One request or reply. A request carries a block only for JBOD_WRITE_BLOCK,
+ * a reply only for JBOD_READ_BLOCK and JBOD_SIGN_BLOCK. */
+typedef struct {
+  uint32_t op;
+  int32_t ret;                    /* the reply's jbod_operation result */
+  uint8_t block[JBOD_BLOCK_SIZE];
+} shm_slot_t;
+
+/* A ring of slots. head and tail count slots produced and consumed since the
+ * region was set up, and wrap; each has a flag its waiter raises before it
+ * sleeps on it with futex, so the other side knows to wake it. They sit on
+ * cache lines of their own, as each is written by one side only. */
+typedef struct {
+  uint32_t head;
+  uint32_t head_waiting;          /* the consumer sleeps until head moves */
+  uint8_t pad1[56];
+  uint32_t tail;
+  uint32_t tail_waiting;          /* the producer sleeps until tail moves */
+  uint8_t pad2[56];
+  shm_slot_t slots[SHM_RING_SLOTS];
+} shm_ring_t;
+
+/* The shared-memory file */
+typedef struct {
+  char magic[8];
+  pid_t server_pid;
+  pid_t client_pid;               /* the client attached, or 0 */
+  shm_ring_t requests;
+  shm_ring_t replies;
+} shm_region_t;
+
+/* Creates the shared-memory file |name| (as for shm_open) and sets it up for
+ * clients; returns the region, or NULL on failure. */
+shm_region_t *shm_create(const char *name);
+
+/* Unmaps the region and removes the file |name| shm_create made. */
+void shm_destroy(shm_region_t *region, const char *name);
+
+/* Maps the region shm_server serves at |name| and claims it for this process;
+ * returns NULL on failure, or if another live client has it. A region left
+ * behind by a client that died is taken over once its replies are skipped. */
+shm_region_t *shm_attach(const char *name);
+
+/* Gives up the claim on the region and unmaps it. */
+void shm_detach(shm_region_t *region);
+
+/* Producer side: returns how many slots are free, and the |i|th of them. */
+uint32_t shm_ring_space(shm_ring_t *ring);
+shm_slot_t *shm_ring_free_slot(shm_ring_t *ring, uint32_t i);
+
+/* Producer side: hands the first |n| free slots to the consumer, waking it if
+ * it sleeps. Returns the number of system calls made. */
+int shm_ring_publish(shm_ring_t *ring, uint32_t n);
+
+/* Consumer side: returns how many slots are waiting, and the |i|th of them. */
+uint32_t shm_ring_ready(shm_ring_t *ring);
+shm_slot_t *shm_ring_ready_slot(shm_ring_t *ring, uint32_t i);
+
+/* Consumer side: gives the first |n| waiting slots back to the producer,
+ * waking it if it sleeps. Returns the number of system calls made. */
+int shm_ring_release(shm_ring_t *ring, uint32_t n);
+
+/* Waits up to |timeout_ms| (-1 for no limit) until |ring| has a slot waiting
+ * (or, for shm_ring_wait_space, free), spinning a while before sleeping.
+ * Returns 1 once it has, 0 on timeout, and -1 if |peer| (when not 0) exits
+ * meanwhile. Adds the system calls made to |*num_syscalls|. */
+int shm_ring_wait_ready(shm_ring_t *ring, int timeout_ms, pid_t peer, unsigned long *num_syscalls);
+int shm_ring_wait_space(shm_ring_t *ring, int timeout_ms, pid_t peer, unsigned long *num_syscalls);
+
+#endif
@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <unistd.h>
+#include <err.h>
+
+#include "jbod.h"
+#include "shm.h"
+#include "tester.h"
+
+#define SERVER_ARGUMENTS "hn:v"
+#define USAGE                                                               \
+  "USAGE: shm_server [-h] [-n name] [-v]\n"                                 \
+  "\n"                                                                      \
+  "where:\n"                                                                \
+  "    -h - help mode (display this message)\n"                             \
+  "    -n - serve at this shared-memory name (default " SHM_DEFAULT_NAME ");\n" \
+  "         clients connect to it as shm:name\n"                           \
+  "    -v - print the cost of the operations served on exit\n"            \
+  "\n"                                                                      \
+
+/* How long a wait lasts before the loop checks for a signal to stop */
+#define POLL_MS 100
+
+static volatile sig_atomic_t stopping = 0;
+
+static void stop(int sig) {
+  (void) sig;
+  stopping = 1;
+}
+
+/* Answers the requests waiting in |region|, in order, as jbod_operation does
+ * them; returns the number answered. A read writes its block straight into
+ * the reply slot, and a write takes its block from the request slot. */
+static uint32_t serve(shm_region_t *region, unsigned long *num_syscalls) {
+  uint32_t n = shm_ring_ready(&region->requests);
+  uint32_t space = shm_ring_space(&region->replies);
+  if (n > space) {
+    n = space;
+  }
+
+  for (uint32_t i = 0; i < n; ++i) {
+    shm_slot_t *request = shm_ring_ready_slot(&region->requests, i);
+    shm_slot_t *reply = shm_ring_free_slot(&region->replies, i);
+    uint32_t op = request->op;
+    uint8_t *block = (((op >> 14) & 0x3f) == JBOD_WRITE_BLOCK) ? request->block : reply->block;
+    reply->ret = jbod_operation(op, block);
+    reply->op = op;
+  }
+
+  // Replies go out before the requests are given back (see skip_stale in shm.c)
+  *num_syscalls += shm_ring_publish(&region->replies, n);
+  *num_syscalls += shm_ring_release(&region->requests, n);
+  return n;
+}
+
+int main(int argc, char *argv[])
+{
+  int ch;
+  const char *name = SHM_DEFAULT_NAME;
+  bool verbose = false;
+
+  while ((ch = getopt(argc, argv, SERVER_ARGUMENTS)) != -1) {
+    switch (ch) {
+      case 'h':
+        fprintf(stderr, USAGE);
+        return 0;
+      case 'n':
+        name = optarg;
+        break;
+      case 'v':
+        verbose = true;
+        break;
+      default:
+        fprintf(stderr, "Unknown command line option (%c), aborting.\n", ch);
+        return -1;
+    }
+  }
+
+  struct sigaction sa = { .sa_handler = stop };
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  shm_region_t *region = shm_create(name);
+  if (!region)
+    err(1, "Cannot create shared memory %s", name);
+
+  unsigned long num_syscalls = 0, num_ops = 0;
+  while (!stopping) {
+    /* a full reply ring waits for the client to take some, an empty request
+       ring for it to send some */
+    int rc = shm_ring_space(&region->replies) == 0
+               ? shm_ring_wait_space(&region->replies, POLL_MS, 0, &num_syscalls)
+               : shm_ring_wait_ready(&region->requests, POLL_MS, 0, &num_syscalls);
+    if (rc == 1)
+      num_ops += serve(region, &num_syscalls);
+  }
+
+  shm_destroy(region, name);
+  if (verbose) {
+    fprintf(stderr, "Served %lu operations with %lu system calls.\n", num_ops, num_syscalls);
+    jbod_print_cost();
+  }
+  return 0;
+}
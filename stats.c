@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "stats.h"
+
+uint64_t stats_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Returns the bucket that counts a latency of |ns| nanoseconds. */
+static int bucket_of(uint64_t ns) {
+  uint64_t us = ns / 1000;
+  int i = 0;
+  // Bucket i > 0 ends at 2^i us, so it is one past the highest bit of |us|
+  while (us > 0 && i < STATS_HIST_BUCKETS - 1) {
+    us >>= 1;
+    i++;
+  }
+  return i;
+}
+
+/* Returns the upper bound of bucket |i| in microseconds. */
+static uint64_t bucket_limit_us(int i) {
+  return (uint64_t) 1 << i;
+}
+
+void stats_hist_record(stats_hist_t *hist, uint64_t start_ns) {
+  uint64_t ns = stats_now_ns() - start_ns;
+
+  // Every field is updated on its own, so a concurrent copy may see a record
+  // half done; the counts never go backwards, which is all a report needs.
+  __atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&hist->total_ns, ns, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&hist->buckets[bucket_of(ns)], 1, __ATOMIC_RELAXED);
+  uint64_t max = __atomic_load_n(&hist->max_ns, __ATOMIC_RELAXED);
+  while (ns > max && !__atomic_compare_exchange_n(&hist->max_ns, &max, ns, true,
+                                                  __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+
+void stats_hist_copy(stats_hist_t *dst, const stats_hist_t *src) {
+  dst->count = __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+  dst->total_ns = __atomic_load_n(&src->total_ns, __ATOMIC_RELAXED);
+  dst->max_ns = __atomic_load_n(&src->max_ns, __ATOMIC_RELAXED);
+  for (int i = 0; i < STATS_HIST_BUCKETS; i++) {
+    dst->buckets[i] = __atomic_load_n(&src->buckets[i], __ATOMIC_RELAXED);
+  }
+}
+
+uint64_t stats_hist_percentile_us(const stats_hist_t *hist, double pct) {
+  uint64_t total = 0;
+  for (int i = 0; i < STATS_HIST_BUCKETS; i++) {
+    total += hist->buckets[i];
+  }
+  if (total == 0) {
+    return 0;
+  }
+
+  // The first bucket by which at least |pct| percent of the latencies are in
+  uint64_t seen = 0;
+  for (int i = 0; i < STATS_HIST_BUCKETS; i++) {
+    seen += hist->buckets[i];
+    if (seen * 100.0 >= pct * total) {
+      return bucket_limit_us(i);
+    }
+  }
+  return bucket_limit_us(STATS_HIST_BUCKETS - 1);
+}
+
+void stats_hist_print_json(FILE *f, const stats_hist_t *hist) {
+  fprintf(f, "{\"count\": %llu, \"mean_us\": %.2f, \"max_us\": %.2f, ",
+          (unsigned long long) hist->count,
+          hist->count ? hist->total_ns / 1000.0 / hist->count : 0.0,
+          hist->max_ns / 1000.0);
+  fprintf(f, "\"p50_us\": %llu, \"p90_us\": %llu, \"p99_us\": %llu, \"buckets\": [",
+          (unsigned long long) stats_hist_percentile_us(hist, 50),
+          (unsigned long long) stats_hist_percentile_us(hist, 90),
+          (unsigned long long) stats_hist_percentile_us(hist, 99));
+
+  // Only the buckets anything fell into, each by its upper bound
+  const char *sep = "";
+  for (int i = 0; i < STATS_HIST_BUCKETS; i++) {
+    if (hist->buckets[i] > 0) {
+      fprintf(f, "%s{\"le_us\": %llu, \"count\": %llu}", sep,
+              (unsigned long long) bucket_limit_us(i), (unsigned long long) hist->buckets[i]);
+      sep = ", ";
+    }
+  }
+  fprintf(f, "]}");
+}
@@ -0,0 +1,36 @@
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Buckets of a latency histogram. Bucket 0 counts latencies under 1us, bucket
+ * i those from 2^(i-1) up to 2^i us, and the last one everything longer. */
+#define STATS_HIST_BUCKETS 32
+
+typedef struct {
+  uint64_t count;
+  uint64_t total_ns;
+  uint64_t max_ns;
+  uint64_t buckets[STATS_HIST_BUCKETS];
+} stats_hist_t;
+
+/* Returns a monotonic timestamp in nanoseconds. */
+uint64_t stats_now_ns(void);
+
+/* Records the time elapsed since |start_ns|, a stats_now_ns timestamp, in
+ * |hist|. Safe to call from several threads at once. */
+void stats_hist_record(stats_hist_t *hist, uint64_t start_ns);
+
+/* Copies |src| to |dst|, which may be read while |src| is being recorded to. */
+void stats_hist_copy(stats_hist_t *dst, const stats_hist_t *src);
+
+/* Returns the upper bound, in microseconds, of the bucket that holds the
+ * |pct|th percentile of |hist|, or 0 if it is empty. */
+uint64_t stats_hist_percentile_us(const stats_hist_t *hist, double pct);
+
+/* Writes |hist| to |f| as a JSON object: its count, mean, maximum and a few
+ * percentiles in microseconds, and the non-empty buckets by upper bound. */
+void stats_hist_print_json(FILE *f, const stats_hist_t *hist);
+
+#endif
@@ -10,28 +10,87 @@
 #include <fcntl.h>
 #include <err.h>
 #include <assert.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "cache.h"
 #include "jbod.h"
 #include "mdadm.h"
 #include "util.h"
 #include "tester.h"
+#include "blockmap.h"
 #include "net.h"
+#include "trace.h"
 
-#define TESTER_ARGUMENTS "hw:s:"
-#define USAGE                                               \
-  "USAGE: test [-h] [-w workload-file] [-s cache_size] \n"  \
-  "\n"                                                      \
-  "where:\n"                                                \
-  "    -h - help mode (display this message)\n"             \
-  "\n"                                                      \
+#define TESTER_ARGUMENTS "hw:s:Wr:n:t:S:q:p:j:C:m:k:L:bDzZM:"
+#define USAGE                                                               \
+  "USAGE: test [-h] [-w workload-file] [-s cache_size] [-W] [-r window]\n"  \
+  "            [-n connections] [-t threads] [-S stripe_unit] [-q depth]\n"\
+  "            [-p policy] [-j stats-file] [-C trace-file] [-m name]\n"  \
+  "            [-k snapshot-file] [-L l2-file] [-b] [-D] [-z] [-Z]\n"  \
+  "            [-M map-file]\n"                                          \
+  "\n"                                                                      \
+  "where:\n"                                                                \
+  "    -h - help mode (display this message)\n"                             \
+  "    -W - write-back caching, requires -s\n"                              \
+  "    -r - read ahead up to window blocks of sequential reads (max 64),\n" \
+  "         requires -s\n"                                                 \
+  "    -n - open this many more connections (max 16) and serve requests\n" \
+  "         spanning several disks on all of them at once\n"               \
+  "    -t - split the reads and writes between each MOUNT, UNMOUNT and\n"  \
+  "         SIGNALL across this many threads (max 64), each with its\n"    \
+  "         own connection, and report the throughput\n"                   \
+  "    -S - stripe the volume across the disks (RAID-0) in units of\n"     \
+  "         stripe_unit bytes, a power of two from 256 to 65536\n"         \
+  "    -q - replay the reads and writes asynchronously, keeping up to\n"   \
+  "         depth of them (max 256) in flight\n"                           \
+  "    -p - evict from the cache by this replacement policy: lru (the\n"   \
+  "         default), clock or 2q\n"                                       \
+  "    -j - write the counters and latency histograms of the run to\n"    \
+  "         stats-file as JSON\n"                                          \
+  "    -C - convert the workload to a binary trace in trace-file and\n"   \
+  "         exit; -w takes either kind of workload\n"                     \
+  "    -m - talk to shm_server at this shared-memory name (such as\n"    \
+  "         /jbod) instead of the TCP server; cannot be combined with\n"  \
+  "         -n or -t\n"                                                   \
+  "    -k - save the cache to snapshot-file on exit, and start from it,\n" \
+  "         if it still matches the volume, on the next run; requires -s\n" \
+  "    -L - demote blocks evicted from the cache to a second tier in\n"  \
+  "         l2-file, big enough for the whole volume; requires -s\n"     \
+  "    -b - sign the blocks for SIGNALL here, reading the volume in\n"   \
+  "         bulk and hashing it on several threads, rather than asking\n" \
+  "         the server to sign each block\n"                             \
+  "    -D - deduplicate the cache: blocks with the same contents share\n" \
+  "         their memory, so cache_size blocks' worth holds up to four\n" \
+  "         times as many; requires -s\n"                                \
+  "    -z - compress the cache: cache_size blocks' worth of memory holds\n" \
+  "         up to eight times as many blocks, as they shrink; requires -s\n" \
+  "    -Z - keep a map of the blocks known to hold one repeated byte,\n"  \
+  "         such as those never written since MOUNT zeroed them, and\n"   \
+  "         read those without asking the server\n"                       \
+  "    -M - -Z, saving the map to map-file on UNMOUNT and starting from\n" \
+  "         it on MOUNT, for a server that keeps its disks (server -i)\n"  \
+  "\n"                                                                      \
 
-int run_workload(char *workload, int cache_size);
+/* Most threads -t accepts */
+#define MAX_THREADS 64
+
+/* Most requests -q keeps in flight */
+#define MAX_QUEUE_DEPTH 256
+
+int run_workload(char *workload, int cache_size, bool write_back, int num_threads, int queue_depth,
+                 bool bulk_sign);
+static void dump_stats(const char *path);
 
 int main(int argc, char *argv[])
 {
-  int ch, cache_size = 0;
+  int ch, cache_size = 0, readahead = 0, num_conns = 0, num_threads = 0, stripe_unit = 0, queue_depth = 0;
+  bool write_back = false, bulk_sign = false;
   char *workload = NULL;
+  char *stats_file = NULL;
+  char *trace_file = NULL;
+  char server[256] = JBOD_SERVER;
+  cache_policy_t policy;
 
   while ((ch = getopt(argc, argv, TESTER_ARGUMENTS)) != -1) {
     switch (ch) {
@@ -44,6 +103,80 @@ int main(int argc, char *argv[])
       case 'w':
         workload = optarg;
         break;
+      case 'W':
+        write_back = true;
+        break;
+      case 'r':
+        readahead = atoi(optarg);
+        break;
+      case 'n':
+        num_conns = atoi(optarg);
+        break;
+      case 't':
+        num_threads = atoi(optarg);
+        if (num_threads < 1 || num_threads > MAX_THREADS) {
+          fprintf(stderr, "Invalid number of threads %d, aborting.\n", num_threads);
+          return -1;
+        }
+        break;
+      case 'S':
+        stripe_unit = atoi(optarg);
+        break;
+      case 'q':
+        queue_depth = atoi(optarg);
+        if (queue_depth < 1 || queue_depth > MAX_QUEUE_DEPTH) {
+          fprintf(stderr, "Invalid queue depth %d, aborting.\n", queue_depth);
+          return -1;
+        }
+        break;
+      case 'j':
+        stats_file = optarg;
+        break;
+      case 'C':
+        trace_file = optarg;
+        break;
+      case 'm':
+        snprintf(server, sizeof(server), "%s%s", JBOD_SHM_PREFIX, optarg);
+        break;
+      case 'z':
+        cache_set_compression(true);
+        break;
+      case 'D':
+        cache_set_dedup(true);
+        break;
+      case 'b':
+        bulk_sign = true;
+        break;
+      case 'Z':
+        blockmap_set(true, NULL);
+        break;
+      case 'M':
+        if (blockmap_set(true, optarg) != 1) {
+          fprintf(stderr, "Invalid block map file %s, aborting.\n", optarg);
+          return -1;
+        }
+        break;
+      case 'L':
+        if (cache_set_l2(optarg) != 1) {
+          fprintf(stderr, "Invalid L2 file %s, aborting.\n", optarg);
+          return -1;
+        }
+        break;
+      case 'k':
+        if (cache_set_snapshot(optarg) != 1) {
+          fprintf(stderr, "Invalid snapshot file %s, aborting.\n", optarg);
+          return -1;
+        }
+        break;
+      case 'p':
+        for (policy = 0; policy < CACHE_NUM_POLICIES; policy++)
+          if (strcmp(optarg, cache_policy_name(policy)) == 0)
+            break;
+        if (cache_set_policy(policy) != 1) {
+          fprintf(stderr, "Unknown cache policy %s, aborting.\n", optarg);
+          return -1;
+        }
+        break;
       default:
         fprintf(stderr, "Unknown command line option (%c), aborting.\n", ch);
         return -1;
@@ -55,11 +188,39 @@ int main(int argc, char *argv[])
     return -1;
   }
 
-  if (!jbod_connect(JBOD_SERVER, JBOD_PORT))
+  if (trace_file) {
+    if (trace_convert(workload, trace_file) != 1)
+      errx(1, "Cannot convert %s to a binary trace in %s", workload, trace_file);
+    return 0;
+  }
+
+  if (num_threads && queue_depth) {
+    fprintf(stderr, "-t and -q cannot be combined, aborting.\n");
     return -1;
+  }
+
+  if (mdadm_set_readahead(readahead) != 1) {
+    fprintf(stderr, "Invalid readahead window %d, aborting.\n", readahead);
+    return -1;
+  }
+
+  if (stripe_unit && mdadm_set_layout(MDADM_STRIPED, stripe_unit) != 1) {
+    fprintf(stderr, "Invalid stripe unit %d, aborting.\n", stripe_unit);
+    return -1;
+  }
+
+  if (!jbod_connect(server, JBOD_PORT))
+    return -1;
+  if (num_conns && !jbod_connect_pool(server, JBOD_PORT, num_conns)) {
+    fprintf(stderr, "Failed to open %d more connections, aborting.\n", num_conns);
+    jbod_disconnect();
+    return -1;
+  }
   
-  run_workload(workload, cache_size);
+  run_workload(workload, cache_size, write_back, num_threads, queue_depth, bulk_sign);
   jbod_disconnect();
+  if (stats_file)
+    dump_stats(stats_file);
 
   return 0;
 }
@@ -80,33 +241,270 @@ uint32_t op = 0;
   return op;
 }
 
-int run_workload(char *workload, int cache_size) {
-  char line[256], cmd[32];
-  uint8_t buf[MAX_IO_SIZE];
-  uint32_t addr, len, ch;
-  int rc;
+/* Exits with a message naming |op|, the |line_num|th command of the workload. */
+static void op_failed(const trace_op_t *op, int line_num) {
+  char line[64];
 
-  memset(buf, 0, MAX_IO_SIZE);
+  trace_format(op, line, sizeof(line));
+  errx(1, "tester failed when processing command [%s] on line %d", line, line_num);
+}
 
-  FILE *f = fopen(workload, "r");
-  if (!f)
+/* Runs one READ or WRITE of the workload, using |buf| for the data. Returns
+ * what mdadm returned. */
+static int run_io_op(const trace_op_t *op, uint8_t *buf) {
+  if (op->cmd == TRACE_READ)
+    return (op->len > MAX_IO_SIZE) ? mdadm_stream_read(op->addr, op->len, buf) : mdadm_read(op->addr, op->len, buf);
+  memset(buf, op->fill, op->len);
+  return (op->len > MAX_IO_SIZE) ? mdadm_stream_write(op->addr, op->len, buf) : mdadm_write(op->addr, op->len, buf);
+}
+
+/* A request -q has in flight */
+typedef struct {
+  bool busy;
+  uint32_t first_block;    // the blocks it touches, which no request
+  uint32_t last_block;     // issued after it may touch until it is done
+  uint8_t *buf;
+  trace_op_t op;
+  int line_num;
+} inflight_t;
+
+static inflight_t inflight[MAX_QUEUE_DEPTH];
+static int num_inflight = 0;
+
+static void io_done(int id, int result, void *arg) {
+  inflight_t *req = arg;
+
+  if (result == -1)
+    op_failed(&req->op, req->line_num);
+  free(req->buf);
+  req->busy = false;
+  --num_inflight;
+}
+
+/* Returns true if a request in flight touches any of blocks |first| to |last|. */
+static bool overlaps_inflight(uint32_t first, uint32_t last, int queue_depth) {
+  for (int i = 0; i < queue_depth; ++i)
+    if (inflight[i].busy && first <= inflight[i].last_block && inflight[i].first_block <= last)
+      return true;
+  return false;
+}
+
+/* Issues one READ or WRITE of the workload asynchronously, once fewer than
+ * |queue_depth| requests are in flight and none of them overlaps it. */
+static void start_io_op(const trace_op_t *op, int line_num, int queue_depth) {
+  uint32_t addr = op->addr, len = op->len;
+  int id;
+
+  uint32_t first = addr / JBOD_BLOCK_SIZE;
+  uint32_t last = (len ? addr + len - 1 : addr) / JBOD_BLOCK_SIZE;
+  while (num_inflight == queue_depth || overlaps_inflight(first, last, queue_depth))
+    if (mdadm_poll(-1) == -1)
+      errx(1, "tester lost the connection on line %d", line_num);
+
+  inflight_t *req = inflight;
+  while (req->busy)
+    ++req;
+  req->busy = true;
+  req->first_block = first;
+  req->last_block = last;
+  req->buf = malloc(len ? len : 1);
+  req->op = *op;
+  req->line_num = line_num;
+  ++num_inflight;
+
+  if (op->cmd == TRACE_READ) {
+    id = mdadm_read_async(addr, len, req->buf, io_done, req);
+  } else {
+    memset(req->buf, op->fill, len);
+    id = mdadm_write_async(addr, len, req->buf, io_done, req);
+  }
+  if (id == -1)
+    op_failed(op, line_num);
+}
+
+/* A READ or WRITE held back for the workload threads */
+typedef struct {
+  trace_op_t op;
+  int line_num;
+} io_line_t;
+
+/* A workload thread and the slice of the held back ops it runs */
+typedef struct {
+  pthread_t thread;
+  io_line_t *lines;
+  int num_lines;
+} io_thread_t;
+
+static void *io_thread_main(void *arg) {
+  io_thread_t *t = arg;
+  uint8_t *buf = malloc(MAX_STREAM_IO_SIZE);
+
+  if (!buf || mdadm_thread_attach() != 1)
+    errx(1, "Failed to start a workload thread.");
+  for (int i = 0; i < t->num_lines; ++i)
+    if (run_io_op(&t->lines[i].op, buf) == -1)
+      op_failed(&t->lines[i].op, t->lines[i].line_num);
+  mdadm_thread_detach();
+  free(buf);
+  return NULL;
+}
+
+/* Splits the held back lines into |num_threads| contiguous slices, runs them at
+ * once, one thread each, and waits for all of them. */
+static void run_io_batch(io_line_t *lines, int num_lines, int num_threads) {
+  io_thread_t threads[MAX_THREADS];
+
+  for (int i = 0; i < num_threads; ++i) {
+    int first = (int) ((long) num_lines * i / num_threads);
+    int last = (int) ((long) num_lines * (i + 1) / num_threads);
+    threads[i].lines = lines + first;
+    threads[i].num_lines = last - first;
+    if (pthread_create(&threads[i].thread, NULL, io_thread_main, &threads[i]) != 0)
+      errx(1, "Failed to start a workload thread.");
+  }
+  for (int i = 0; i < num_threads; ++i)
+    pthread_join(threads[i].thread, NULL);
+}
+
+/* Most threads sign_volume hashes on */
+#define MAX_SIGN_THREADS 16
+
+/* Room for one line of SIGNALL output */
+#define SIGN_LINE_LEN 128
+
+/* A thread of sign_volume and the blocks it signs, numbered disk by disk */
+typedef struct {
+  pthread_t thread;
+  const uint8_t *volume;
+  int first;
+  int last;
+  char (*lines)[SIGN_LINE_LEN];
+} sign_thread_t;
+
+static void *sign_blocks(void *arg) {
+  sign_thread_t *t = arg;
+  char sig[SHA1_SIG_LEN];
+
+  for (int n = t->first; n < t->last; ++n) {
+    int disk_num = n / JBOD_NUM_BLOCKS_PER_DISK, block_num = n % JBOD_NUM_BLOCKS_PER_DISK;
+    const uint8_t *block = t->volume + mdadm_block_addr(disk_num, block_num);
+    snprintf(t->lines[n], SIGN_LINE_LEN, "SIG(disk,block)%3d %3d : %s\n", disk_num, block_num,
+             sha1_sig_r(block, JBOD_BLOCK_SIZE, sig));
+  }
+  return NULL;
+}
+
+/* Prints what SIGN_BLOCK returns for every block, without asking the server:
+ * reads the whole volume into |volume| with one pipelined stream read, then
+ * signs the blocks on as many threads as there are CPUs, the calling thread
+ * among them. Returns 1 on success and -1 on failure. */
+static int sign_volume(uint8_t *volume)
+{
+  static char lines[JBOD_NUM_DISKS * JBOD_NUM_BLOCKS_PER_DISK][SIGN_LINE_LEN];
+  sign_thread_t threads[MAX_SIGN_THREADS];
+  int num_blocks = JBOD_NUM_DISKS * JBOD_NUM_BLOCKS_PER_DISK;
+  long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+  if (num_threads < 1)
+    num_threads = 1;
+  if (num_threads > MAX_SIGN_THREADS)
+    num_threads = MAX_SIGN_THREADS;
+  if (mdadm_stream_read(0, MDADM_VOLUME_SIZE, volume) != MDADM_VOLUME_SIZE)
+    return -1;
+
+  for (int i = 0; i < num_threads; ++i) {
+    threads[i].volume = volume;
+    threads[i].first = num_blocks * i / num_threads;
+    threads[i].last = num_blocks * (i + 1) / num_threads;
+    threads[i].lines = lines;
+    if (i > 0 && pthread_create(&threads[i].thread, NULL, sign_blocks, &threads[i]) != 0)
+      errx(1, "Failed to start a signing thread.");
+  }
+  sign_blocks(&threads[0]);
+  for (int i = 1; i < num_threads; ++i)
+    pthread_join(threads[i].thread, NULL);
+
+  for (int n = 0; n < num_blocks; ++n)
+    fputs(lines[n], stdout);
+  return 1;
+}
+
+int run_workload(char *workload, int cache_size, bool write_back, int num_threads, int queue_depth,
+                 bool bulk_sign) {
+  static uint8_t buf[MAX_STREAM_IO_SIZE];
+  trace_t trace;
+  const trace_op_t *op;
+  int rc;
+  io_line_t *batch = NULL;
+  int batch_len = 0, batch_cap = 0, num_io = 0;
+  struct timespec started, finished;
+
+  if (trace_open(workload, &trace) != 1)
     err(1, "Cannot open workload file %s", workload);
 
   if (cache_size) {
-    rc = cache_create(cache_size);
+    /* threads share the cache, so give them a shard each to contend less */
+    int num_shards = num_threads ? num_threads : 1;
+    if (num_shards > CACHE_MAX_SHARDS)
+      num_shards = CACHE_MAX_SHARDS;
+    if (num_shards > cache_size / 2)
+      num_shards = cache_size / 2;
+    rc = cache_create_sharded(cache_size, num_shards);
     if (rc != 1)
       errx(1, "Failed to create cache.");
+    mdadm_set_write_back(write_back);
   }
 
+  clock_gettime(CLOCK_MONOTONIC, &started);
   int line_num = 0;
-  while (fgets(line, 256, f)) {
-    ++line_num;
-    line[strlen(line)-1] = '\0';
-    if (equals(line, "MOUNT")) {
+  while ((rc = trace_next(&trace, &op)) != 0) {
+    line_num = trace.position;
+    if (rc == -1)
+      errx(1, "Failed to parse command: [%s], aborting.", trace.line);
+    bool is_io = (op->cmd == TRACE_READ || op->cmd == TRACE_WRITE);
+    if (is_io) {
+      if (op->len > MAX_STREAM_IO_SIZE)
+        op_failed(op, line_num);
+      ++num_io;
+    }
+
+    /* with -t, reads and writes are held back and run by the threads; any
+     * other command waits for those before it to finish */
+    if (num_threads && is_io) {
+      if (batch_len == batch_cap) {
+        batch_cap = batch_cap ? 2 * batch_cap : 1024;
+        batch = realloc(batch, batch_cap * sizeof(io_line_t));
+        if (!batch)
+          err(1, "Cannot hold back workload lines");
+      }
+      batch[batch_len].op = *op;
+      batch[batch_len].line_num = line_num;
+      ++batch_len;
+      continue;
+    }
+    if (batch_len) {
+      run_io_batch(batch, batch_len, num_threads);
+      batch_len = 0;
+    }
+    /* with -q, reads and writes are issued asynchronously; any other command
+     * waits for those in flight */
+    if (queue_depth && is_io) {
+      start_io_op(op, line_num, queue_depth);
+      continue;
+    }
+    if (queue_depth && mdadm_async_drain() == -1)
+      errx(1, "tester failed before line %d", line_num);
+
+    if (op->cmd == TRACE_MOUNT) {
       rc = mdadm_mount();
-    } else if (equals(line, "UNMOUNT")) {
+    } else if (op->cmd == TRACE_UNMOUNT) {
       rc = mdadm_unmount();
-    } else if (equals(line, "SIGNALL")) {
+    } else if (op->cmd == TRACE_SIGNALL && bulk_sign) {
+      /* reads go through the cache, which has the latest of every block */
+      rc = sign_volume(buf);
+    } else if (op->cmd == TRACE_SIGNALL) {
+      /* signatures are computed on the server, so it must see every write */
+      rc = cache_flush();
       for (int i = 0; i < JBOD_NUM_DISKS; ++i)
         for (int j = 0; j < JBOD_NUM_BLOCKS_PER_DISK; ++j) {
           uint8_t b[JBOD_BLOCK_SIZE];
@@ -114,28 +512,93 @@ int run_workload(char *workload, int cache_size) {
           fprintf(stdout, "%s", b);
         }
     } else {
-      if (sscanf(line, "%7s %7u %4u %3u", cmd, &addr, &len, &ch) != 4)
-        errx(1, "Failed to parse command: [%s\n], aborting.", line);
-      if (equals(cmd, "READ")) {
-        rc = mdadm_read(addr, len, buf);
-      } else if (equals(cmd, "WRITE")) {
-        memset(buf, ch, len);
-        rc = mdadm_write(addr, len, buf);
-      } else {
-        errx(1, "Unknown command [%s] on line %d, aborting.", line, line_num);
-      }
+      rc = run_io_op(op, buf);
     }
 
     if (rc == -1)
-      errx(1, "tester failed when processing command [%s] on line %d", line, line_num);
+      op_failed(op, line_num);
   }
-  fclose(f);
+  if (batch_len)
+    run_io_batch(batch, batch_len, num_threads);
+  if (queue_depth && mdadm_async_drain() == -1)
+    errx(1, "tester failed at the end of the workload");
+  free(batch);
+  trace_close(&trace);
+  clock_gettime(CLOCK_MONOTONIC, &finished);
 
-  if (cache_size)
-    cache_destroy();
+  if (cache_size && cache_destroy() != 1)
+    warnx("Failed to save the cache snapshot.");
 
   jbod_print_cost();
   cache_print_hit_rate();
+  blockmap_print();
+  jbod_print_syscalls_per_op();
+  double secs = (finished.tv_sec - started.tv_sec) + (finished.tv_nsec - started.tv_nsec) / 1e9;
+  if (num_threads)
+    fprintf(stderr, "Throughput: %.0f ops/s with %d threads\n", num_io / secs, num_threads);
+  if (queue_depth)
+    fprintf(stderr, "Throughput: %.0f ops/s at queue depth %d\n", num_io / secs, queue_depth);
 
   return 0;
 }
+
+/* Writes what mdadm, the cache and the connections counted to |path| as JSON. */
+static void dump_stats(const char *path)
+{
+  static const char *cmd_names[JBOD_NUM_CMDS] = {
+    "MOUNT", "UNMOUNT", "SEEK_TO_DISK", "SEEK_TO_BLOCK", "READ_BLOCK", "WRITE_BLOCK", "SIGN_BLOCK",
+  };
+  mdadm_stats_t md;
+  cache_stats_t cs;
+  blockmap_stats_t bs;
+  jbod_stats_t js;
+  mdadm_get_stats(&md);
+  cache_get_stats(&cs);
+  blockmap_get_stats(&bs);
+  jbod_get_stats(&js);
+
+  FILE *f = fopen(path, "w");
+  if (!f)
+    err(1, "Cannot open stats file %s", path);
+
+  fprintf(f, "{\n  \"mdadm\": {\"reads\": %llu, \"writes\": %llu, \"failed\": %llu, "
+          "\"bytes_read\": %llu, \"bytes_written\": %llu, \"seeks_issued\": %llu, \"seeks_skipped\": %llu,\n",
+          (unsigned long long) md.reads, (unsigned long long) md.writes, (unsigned long long) md.failed,
+          (unsigned long long) md.bytes_read, (unsigned long long) md.bytes_written,
+          (unsigned long long) md.seeks_issued, (unsigned long long) md.seeks_skipped);
+  fprintf(f, "    \"read_latency\": ");
+  stats_hist_print_json(f, &md.read_latency);
+  fprintf(f, ",\n    \"write_latency\": ");
+  stats_hist_print_json(f, &md.write_latency);
+
+  fprintf(f, "},\n  \"cache\": {\"policy\": \"%s\", \"queries\": %llu, \"hits\": %llu, \"misses\": %llu, "
+          "\"insertions\": %llu, \"evictions\": %llu, \"writebacks\": %llu, "
+          "\"prefetched\": %llu, \"prefetch_hits\": %llu, \"prefetch_wasted\": %llu, "
+          "\"restored\": %llu, \"restored_stale\": %llu, \"l2_hits\": %llu, \"demotions\": %llu, "
+          "\"dedup_hits\": %llu, \"dedup_entries\": %llu, \"dedup_bodies\": %llu, "
+          "\"compressed_blocks\": %llu, \"compressed_bytes\": %llu, \"fill_blocks\": %llu},\n",
+          cache_policy_name(cs.policy),
+          (unsigned long long) cs.queries, (unsigned long long) cs.hits, (unsigned long long) cs.misses,
+          (unsigned long long) cs.insertions, (unsigned long long) cs.evictions, (unsigned long long) cs.writebacks,
+          (unsigned long long) cs.prefetched, (unsigned long long) cs.prefetch_hits,
+          (unsigned long long) cs.prefetch_wasted,
+          (unsigned long long) cs.restored, (unsigned long long) cs.restored_stale,
+          (unsigned long long) cs.l2_hits, (unsigned long long) cs.demotions,
+          (unsigned long long) cs.dedup_hits, (unsigned long long) cs.dedup_entries,
+          (unsigned long long) cs.dedup_bodies, (unsigned long long) cs.compressed_blocks,
+          (unsigned long long) cs.compressed_bytes, (unsigned long long) cs.fill_blocks);
+  fprintf(f, "  \"blockmap\": {\"hits\": %llu, \"known\": %llu, \"loaded\": %llu, \"stale\": %llu},\n",
+          (unsigned long long) bs.hits, (unsigned long long) bs.known, (unsigned long long) bs.loaded,
+          (unsigned long long) bs.stale);
+
+  fprintf(f, "  \"jbod\": {\"commands\": {");
+  for (int i = 0; i < JBOD_NUM_CMDS; i++)
+    fprintf(f, "%s\"%s\": %llu", i ? ", " : "", cmd_names[i], (unsigned long long) js.commands[i]);
+  fprintf(f, "}, \"failed\": %llu, \"bytes_sent\": %llu, \"bytes_received\": %llu,\n    \"round_trip\": ",
+          (unsigned long long) js.failed, (unsigned long long) js.bytes_sent, (unsigned long long) js.bytes_received);
+  stats_hist_print_json(f, &js.round_trip);
+  fprintf(f, "}\n}\n");
+
+  if (fclose(f) != 0)
+    err(1, "Cannot write stats file %s", path);
+}
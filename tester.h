@@ -14,4 +14,8 @@ void jbod_print_cost(void);
 
 #define MAX_IO_SIZE 1024
 
+/* Longest request a workload line may carry; longer than MAX_IO_SIZE goes
+ * through the streaming calls */
+#define MAX_STREAM_IO_SIZE (JBOD_NUM_DISKS * JBOD_DISK_SIZE)
+
 #endif
@@ -0,0 +1,171 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "trace.h"
+
+/* The word each command has in a text workload */
+static const char *cmd_names[TRACE_NUM_CMDS] = {
+  [TRACE_MOUNT] = "MOUNT",
+  [TRACE_UNMOUNT] = "UNMOUNT",
+  [TRACE_SIGNALL] = "SIGNALL",
+  [TRACE_READ] = "READ",
+  [TRACE_WRITE] = "WRITE",
+};
+
+int trace_parse_line(const char *line, trace_op_t *op) {
+  char cmd[8];
+  uint32_t addr, len, fill;
+
+  memset(op, 0, sizeof(*op));
+  // The commands without arguments need only start the line
+  for (int c = TRACE_MOUNT; c <= TRACE_SIGNALL; c++) {
+    if (strncmp(line, cmd_names[c], strlen(cmd_names[c])) == 0) {
+      op->cmd = c;
+      return 1;
+    }
+  }
+  if (sscanf(line, "%7s %7u %7u %3u", cmd, &addr, &len, &fill) != 4) {
+    return -1;
+  }
+  if (strcmp(cmd, cmd_names[TRACE_READ]) == 0) {
+    op->cmd = TRACE_READ;
+  } else if (strcmp(cmd, cmd_names[TRACE_WRITE]) == 0) {
+    op->cmd = TRACE_WRITE;
+  } else {
+    return -1;
+  }
+  op->addr = addr;
+  op->len = len;
+  op->fill = fill;
+  return 1;
+}
+
+void trace_format(const trace_op_t *op, char *buf, size_t size) {
+  if (op->cmd == TRACE_READ || op->cmd == TRACE_WRITE) {
+    snprintf(buf, size, "%s %u %u %u", cmd_names[op->cmd], op->addr, op->len, op->fill);
+  } else {
+    snprintf(buf, size, "%s", op->cmd < TRACE_NUM_CMDS ? cmd_names[op->cmd] : "?");
+  }
+}
+
+int trace_open(const char *path, trace_t *trace) {
+  memset(trace, 0, sizeof(*trace));
+
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    close(fd);
+    return -1;
+  }
+
+  // A binary trace is mapped whole; the records are used where they lie
+  if (st.st_size >= (off_t) sizeof(trace_header_t)) {
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+      close(fd);
+      return -1;
+    }
+    const trace_header_t *header = map;
+    if (memcmp(header->magic, TRACE_MAGIC, sizeof(header->magic)) == 0) {
+      close(fd);
+      // A trace cut short, or with trailing bytes, was not written by trace_convert
+      if ((uint64_t) st.st_size != sizeof(trace_header_t) + header->num_ops * sizeof(trace_op_t)) {
+        munmap(map, st.st_size);
+        return -1;
+      }
+      madvise(map, st.st_size, MADV_SEQUENTIAL);
+      trace->map = map;
+      trace->map_len = st.st_size;
+      trace->ops = (const trace_op_t *) (header + 1);
+      trace->num_ops = header->num_ops;
+      return 1;
+    }
+    munmap(map, st.st_size);
+  }
+
+  // Anything else is a text workload
+  trace->text = fdopen(fd, "r");
+  if (trace->text == NULL) {
+    close(fd);
+    return -1;
+  }
+  return 1;
+}
+
+int trace_next(trace_t *trace, const trace_op_t **op) {
+  if (trace->text == NULL) {
+    if (trace->position == trace->num_ops) {
+      return 0;
+    }
+    const trace_op_t *next = &trace->ops[trace->position++];
+    // The records are used as they lie in the file, so one that is not a
+    // command is rejected like a text line that does not parse
+    if (next->cmd >= TRACE_NUM_CMDS) {
+      snprintf(trace->line, sizeof(trace->line), "unknown command %u", next->cmd);
+      return -1;
+    }
+    *op = next;
+    return 1;
+  }
+
+  if (!fgets(trace->line, sizeof(trace->line), trace->text)) {
+    return 0;
+  }
+  trace->position++;
+  trace->line[strcspn(trace->line, "\n")] = '\0';
+  if (trace_parse_line(trace->line, &trace->current) == -1) {
+    return -1;
+  }
+  *op = &trace->current;
+  return 1;
+}
+
+void trace_close(trace_t *trace) {
+  if (trace->text) {
+    fclose(trace->text);
+  }
+  if (trace->map) {
+    munmap(trace->map, trace->map_len);
+  }
+  memset(trace, 0, sizeof(*trace));
+}
+
+int trace_convert(const char *text_path, const char *bin_path) {
+  trace_t trace;
+  if (trace_open(text_path, &trace) == -1) {
+    return -1;
+  }
+  FILE *out = fopen(bin_path, "wb");
+  if (out == NULL) {
+    trace_close(&trace);
+    return -1;
+  }
+
+  // The header goes in last, once the number of ops is known
+  trace_header_t header = { .num_ops = 0 };
+  memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+  bool ok = fseek(out, sizeof(header), SEEK_SET) == 0;
+  const trace_op_t *op;
+  int rc = 0;
+  while (ok && (rc = trace_next(&trace, &op)) == 1) {
+    ok = fwrite(op, sizeof(*op), 1, out) == 1;
+    header.num_ops++;
+  }
+  ok = ok && rc == 0 && fseek(out, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, out) == 1;
+
+  trace_close(&trace);
+  if (fclose(out) != 0 || !ok) {
+    unlink(bin_path);
+    return -1;
+  }
+  return 1;
+}
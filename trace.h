@@ -0,0 +1,72 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stddef.h>
+
+/* The commands of a workload */
+typedef enum {
+  TRACE_MOUNT,
+  TRACE_UNMOUNT,
+  TRACE_SIGNALL,
+  TRACE_READ,
+  TRACE_WRITE,
+  TRACE_NUM_CMDS
+} trace_cmd_t;
+
+/* One command of a workload, as the text line
+ *   READ addr len 0  |  WRITE addr len fill  |  MOUNT  |  UNMOUNT  |  SIGNALL
+ * describes it, and as a binary trace stores it: 12 bytes in host byte order. */
+typedef struct {
+  uint8_t cmd;     /* a trace_cmd_t */
+  uint8_t fill;    /* the byte a WRITE fills its range with */
+  uint16_t unused;
+  uint32_t addr;
+  uint32_t len;
+} trace_op_t;
+
+/* A binary trace starts with this header, followed by num_ops trace_op_t */
+#define TRACE_MAGIC "JBODTRC1"
+typedef struct {
+  char magic[8];
+  uint64_t num_ops;
+} trace_header_t;
+
+/* A workload being read, from a text file a line at a time, or from a binary
+ * trace mapped into memory, whose records are handed out in place. */
+typedef struct {
+  FILE *text;               /* the text file, or NULL for a binary trace */
+  trace_op_t current;       /* the last op parsed from the text */
+  char line[256];           /* the last line read from the text, or what is wrong with a record */
+  const trace_op_t *ops;    /* the records of the binary trace */
+  uint64_t num_ops;
+  void *map;                /* the mapping and its length */
+  size_t map_len;
+  uint64_t position;        /* ops handed out so far: the line number of the last one */
+} trace_t;
+
+/* Returns 1 on success and -1 on failure. Opens the workload at |path|,
+ * which is a binary trace if it starts with TRACE_MAGIC and text otherwise. */
+int trace_open(const char *path, trace_t *trace);
+
+/* Returns 1 and points |*op| at the next command, 0 at the end of the
+ * workload, or -1 if the next line or record is not a command; |line| then
+ * holds the line, or says what is wrong with the record. |*op| stays valid
+ * until the next call, or for a binary trace until trace_close. */
+int trace_next(trace_t *trace, const trace_op_t **op);
+
+/* Closes the workload, unmapping a binary trace. */
+void trace_close(trace_t *trace);
+
+/* Returns 1 on success and -1 on failure. Parses a text workload line into |op|. */
+int trace_parse_line(const char *line, trace_op_t *op);
+
+/* Writes |op| to |buf|, of |size| bytes, as a text workload line without the newline. */
+void trace_format(const trace_op_t *op, char *buf, size_t size);
+
+/* Returns 1 on success and -1 on failure. Converts the text workload at
+ * |text_path| into a binary trace at |bin_path|. */
+int trace_convert(const char *text_path, const char *bin_path);
+
+#endif
@@ -34,7 +34,12 @@ void debug_log(const char *fmt, ...) {
 }
 
 const char *sha1_sig(uint8_t *buf, uint32_t size) {
-  static char sig[80];
+  static char sig[SHA1_SIG_LEN];
+
+  return sha1_sig_r(buf, size, sig);
+}
+
+const char *sha1_sig_r(const uint8_t *buf, uint32_t size, char *sig) {
   uint8_t obuf[20];
 
   SHA1(buf, size, obuf);
@@ -8,6 +8,13 @@ void set_debug_logfile(const char *filename);
 void debug_log(const char *fmt, ...);
 
 const char *sha1_sig(uint8_t *buf, uint32_t size);
+
+/* Room sha1_sig_r needs for a signature */
+#define SHA1_SIG_LEN 80
+
+/* Like sha1_sig, into |sig| instead of a static buffer, so threads can sign
+ * blocks at once; returns |sig|. */
+const char *sha1_sig_r(const uint8_t *buf, uint32_t size, char *sig);
 uint32_t get_rand(uint32_t min, uint32_t max);
 
 #endif